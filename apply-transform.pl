@@ -22,44 +22,25 @@ my @args;
 	@args = split /\s+/, $state->{cmdline};
 }
 
-my @files;
-my @args_files;
+my ( $bender, @numbers ) = @args;
+# bender multiplies onto the background, scales and writes jpegs itself
+my @opts = ( "-b", ( $state->{file_real} || $state->{file} ), "-g", "1024x1024" );
+# rendering at the delivery size right away is faster but lossy along the
+# mug's edge, see -r in README.md; -g then only absorbs rounding
+my $long = $numbers[0] > $numbers[1] ? $numbers[0] : $numbers[1];
+push @opts, "-r", 1024 / $long if $ENV{BENDER_SCALE} and $long > 1024;
+push @opts, "-c", $ENV{BENDER_CACHE} || $ENV{TMPDIR} || "/tmp";
+
+# one daemon builds the table once and gets a job line per file,
+# its status lines end up on our stdout
+warn "Command: $bender @opts -d -\n";
+open my $jobs, '|-', $bender, @opts, "-d", "-"
+	or die "Cannot run $bender: $!\n";
 foreach my $file ( @ARGV )
 {
 	local $_ = $file;
-	s/(\.png)$/$suffix-tmp$1/;
+	s/\.png$/$suffix.jpg/;
 	s#^(.*/)?#$dir#;
-	my $tmp = $_;
-	s/-tmp\.png$/\.jpg/;
-	push @files, {
-		input => $file,
-		tmp => $tmp,
-		output => $_,
-	};
-	push @args_files, $file, $tmp;
-}
-
-while ( my @af = splice @args_files, 0, 200 )
-{
-	warn "Command: @args @af\n";
-	#system "pexec", "add",
-	system @args, @af;
-}
-
-#system "pexec", "wait";
-
-foreach my $file ( @files )
-{
-	#system "pexec", "add",
-	system "convert", "-verbose",
-		( $state->{file_real} || $state->{file} ), $file->{tmp},
-		"-compose", "Multiply", "-composite",
-		"-scale", "1024x1024",
-		$file->{output};
-}
-#system "pexec", "wait";
-
-foreach my $file ( @files )
-{
-	unlink $file->{tmp};
+	print $jobs "@numbers $file $_\n";
 }
+close $jobs or die "$bender failed\n";
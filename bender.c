@@ -6,9 +6,18 @@
  *
  * compile with:
  *
- * gcc -std=c99 -O2 -Wall -lpng -lm bender.c -o bender
+ * gcc -std=c99 -O2 -Wall -pthread -lpng -ljpeg -lm bender.c -o bender
+ *
+ * or as libbender, see bender.h:
+ *
+ * gcc -std=c99 -O2 -Wall -pthread -fPIC -shared -fvisibility=hidden \
+ *     -DBENDER_LIBRARY bender.c -o libbender.so -lpng -ljpeg -lm
+ *
+ * SIMD splat kernels are picked at runtime, do not add -march=native or
+ * -ffp-contract=fast, scalar and SIMD kernels must round the same way.
  */
 
+#define _POSIX_C_SOURCE 200809L /* mkstemp, fileno */
 
 #include <stdio.h>
 #include <math.h>
@@ -16,9 +25,35 @@
 #include <stdlib.h> /* abort() */
 #include <stdbool.h> /* c99 boolean */
 #include <string.h> /* strlen */
+#include <strings.h> /* strcasecmp */
+#include <stdint.h> /* uint64_t */
+#include <limits.h> /* INT_MAX */
+#include <ctype.h> /* isalpha */
+#include <errno.h> /* strtoul range */
+#include <unistd.h> /* close, unlink */
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h> /* fstat */
+#include <fcntl.h> /* open */
+#include <signal.h> /* SIGPIPE */
+#include <time.h> /* clock_gettime */
+#include <sys/socket.h>
+#include <sys/un.h> /* sockaddr_un */
+#include <sys/resource.h> /* getrusage */
+#include <pthread.h>
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 #define PNG_DEBUG 3
 #include <png.h>
+#include <jpeglib.h>
+#include <setjmp.h> /* die_jump */
+
+#ifdef BENDER_LIBRARY
+#include "bender.h"
+#endif
 
 /* always 8-bit RGBA */
 #define BYTES_PER_PIXEL 4
@@ -43,6 +78,15 @@ typedef struct image_file_s
 	long unsigned int height;
 } image_file_t;
 
+/* rectangle of a larger canvas */
+typedef struct image_box_s
+{
+	unsigned long int x;
+	unsigned long int y;
+	unsigned long int width;
+	unsigned long int height;
+} image_box_t;
+
 typedef struct pixel_rgba_s
 {
 	png_byte r;
@@ -51,15 +95,62 @@ typedef struct pixel_rgba_s
 	png_byte a;
 } pixel_rgba_t;
 
+/* weights live in transform_table_t->weights, starting at offset */
+typedef struct bokeh_kernel_s
+{
+	uint16_t width;
+	uint16_t height;
+	uint32_t offset;
+} bokeh_kernel_t;
+
+/* kernel is an index into transform_table_t->kernels */
 typedef struct bokeh_circle_s
 {
-	unsigned long int outx;
-	unsigned long int outy;
-	unsigned long int width;
-	unsigned long int height;
-	double pixel[0];
+	int32_t outx;
+	int32_t outy;
+	uint32_t kernel;
 } bokeh_circle_t;
 
+/*
+ * One buffer for all kernel weights of a table. The bokeh stage only counts
+ * used while it sizes kernels and allocates data once, at its final size.
+ */
+typedef struct weight_arena_s
+{
+	double *data;
+	size_t used;
+	size_t size;
+} weight_arena_t;
+
+/* what the weights of a sized kernel are computed from */
+typedef struct kernel_shape_s
+{
+	double r;
+	double cx;
+	double cy;
+} kernel_shape_t;
+
+/*
+ * Kernels depend only on the radius and on the subpixel phase of the
+ * destination, so with quantization enabled every distinct
+ * ( radius, phase x, phase y ) kernel is built once and shared.
+ */
+typedef struct kernel_bank_s
+{
+	weight_arena_t weights;
+	bokeh_kernel_t *kernels;
+	/* parallel to kernels until the weights are filled in, then NULL */
+	kernel_shape_t *shapes;
+	size_t count;
+	size_t size;
+	/* quantization steps per pixel, 0 = exact kernel for every circle */
+	uint32_t radius_steps;
+	uint32_t phase_steps;
+	/* kernel id + 1 for every quantized triple, 0 if not built yet */
+	uint32_t *index;
+	size_t index_size;
+} kernel_bank_t;
+
 typedef struct pixel_partial_s
 {
 	double r;
@@ -68,6 +159,23 @@ typedef struct pixel_partial_s
 	double a;
 } pixel_partial_t;
 
+/* compact accumulators, see accum_t */
+typedef struct pixel_partial_f_s
+{
+	float r;
+	float g;
+	float b;
+	float a;
+} pixel_partial_f_t;
+
+typedef struct pixel_partial_i_s
+{
+	uint32_t r;
+	uint32_t g;
+	uint32_t b;
+	uint32_t a;
+} pixel_partial_i_t;
+
 typedef struct transform_table_s
 {
 	unsigned long int output_width;
@@ -75,9 +183,54 @@ typedef struct transform_table_s
 	unsigned long int patch_width;
 	unsigned long int patch_height;
 	double alpha_fix;
-	bokeh_circle_t **row_pointers[0];
+	/*
+	 * Union of all kernels on the output, and of their blur if there is a
+	 * blur map. Circles and row_out_first are relative to it, renderers
+	 * allocate and normalize only this part.
+	 */
+	image_box_t box;
+	/* patch_height * patch_width circles in scan order */
+	bokeh_circle_t *circles;
+	bokeh_kernel_t *kernels;
+	size_t kernels_count;
+	double *weights;
+	size_t weights_count;
+	/*
+	 * row_out_first[ y ] is the lowest output row patch rows y and below can
+	 * still touch; rows above it are final once patch row y - 1 is splatted.
+	 * No more than window_rows output rows are being touched at any time.
+	 */
+	int32_t *row_out_first;
+	unsigned long int window_rows;
+	/*
+	 * Box sized map of the blur radii render_scatter() still has to apply,
+	 * NULL if kernels have their full radius, see calc_blur_map().
+	 */
+	float *blur;
+	/* see calc_clip_circles() */
+	unsigned long int circles_dropped;
+	unsigned long int circles_clipped;
+	/* set if everything lives in a mapped table file, see transform_table_from_file() */
+	void *map;
+	size_t map_size;
 } transform_table_t;
 
+/* everything the transform table depends on */
+typedef struct table_params_s
+{
+	coord_t list[ 12 ];
+	/* see kernel_bank_t */
+	uint32_t radius_steps;
+	uint32_t phase_steps;
+	/* output size relative to the background, see calc_transform_table() */
+	double scale;
+	/*
+	 * largest error in 0-255 levels summed-area tables may add, 0 = never
+	 * use them, see sat_cut_ratio()
+	 */
+	double sat_tolerance;
+} table_params_t;
+
 typedef struct args_s
 {
 	coord_int_t bg_size, patch_size;
@@ -108,41 +261,360 @@ typedef struct args_s
 #define POINT_FOCUS_F2		10
 #define POINT_FOCUS_R		11
 
+/*
+ * Set while a daemon job or a library call runs, die() then fails just that
+ * job or call instead of aborting. Only the thread which set it may die
+ * into it, workers_run() clears it while other threads run jobs.
+ */
+static jmp_buf *die_jump;
+/* what the last die() said */
+static char die_message[ 1024 ];
+
+/*
+ * Objects of the job or call in flight, which would leak when die() jumps
+ * out of it. Owners hold them while they are reachable only from the stack
+ * and drop them with die_unhold() once freed or handed on. die() releases
+ * what is still held before it jumps, while the frames holding them are
+ * still there. Nothing is held unless die_jump is set.
+ */
+typedef struct die_hold_s
+{
+	void *object;
+	void (*release)( void *object );
+} die_hold_t;
+
+#define DIE_HOLDS 32
+static die_hold_t die_holds[ DIE_HOLDS ];
+static unsigned int die_holds_count;
+
+/* releases, newest first, what is still held since mark */
+static void
+die_unwind( unsigned int mark ) /* {{{ */
+{
+	while ( die_holds_count > mark )
+	{
+		die_hold_t *h = die_holds + --die_holds_count;
+		h->release( h->object );
+	}
+} /* }}} */
+
 #define die( args... ) die_( args ) /* {{{ */
 void die_( const char *s, ... )
 {
 	va_list args;
 	va_start( args, s );
-	vfprintf( stderr, s, args );
-	fprintf( stderr, "\n" );
+	vsnprintf( die_message, sizeof( die_message ), s, args );
 	va_end( args );
+#ifndef BENDER_LIBRARY
+	/* the library reports failures by return value only */
+	fprintf( stderr, "%s\n", die_message );
+#endif
+	if ( die_jump )
+	{
+		die_unwind( 0 );
+		longjmp( *die_jump, 1 );
+	}
 	abort();
 } /* }}} */
 
-image_file_t *image_from_file( const char *filename ) /* {{{ */
+/* returns the mark to pass to die_unhold() */
+static unsigned int
+die_hold( void *object, void (*release)( void * ) ) /* {{{ */
 {
-	unsigned char header[8];
-	image_file_t *image;
+	unsigned int mark = die_holds_count;
+
+	if ( die_jump )
+	{
+		if ( die_holds_count == DIE_HOLDS )
+			die( "Too many objects held" );
+		die_holds[ die_holds_count ].object = object;
+		die_holds[ die_holds_count ].release = release;
+		die_holds_count++;
+	}
+
+	return mark;
+} /* }}} */
+
+static void
+die_unhold( unsigned int mark )
+{
+	if ( die_holds_count > mark )
+		die_holds_count = mark;
+}
+
+static void
+file_release( void *fp )
+{
+	fclose( fp );
+}
+
+static double
+monotonic_ms( void ) /* {{{ */
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+} /* }}} */
+
+/* phases of an image conversion, for timings */
+typedef enum
+{
+	PHASE_TABLE,
+	PHASE_DECODE,
+	PHASE_SPLAT,
+	PHASE_NORMALIZE,
+	PHASE_ENCODE,
+	PHASE_COUNT,
+} phase_t;
+
+static const char *phase_names[ PHASE_COUNT ] = {
+	"table", "decode", "splat", "normalize", "encode"
+};
+
+/*
+ * Per image statistics, only collected when asked for (-S). Counters are
+ * kept per band during splatting anyway and only summed up here.
+ */
+typedef struct image_stats_s
+{
+	double ms[ PHASE_COUNT ];
+	/* kernel weights applied */
+	uint64_t taps;
+	/* transparent input pixels which were not splatted */
+	uint64_t skipped;
+	size_t table_bytes;
+	size_t accum_bytes;
+} image_stats_t;
+
+/* adds the time since *t to phase and restarts *t, no-op without stats */
+static inline void
+stats_lap( image_stats_t *stats, phase_t phase, double *t )
+{
+	double now;
+	if ( !stats )
+		return;
+	now = monotonic_ms();
+	stats->ms[ phase ] += now - *t;
+	*t = now;
+}
+
+/* JSON string with the few escapes file names can need */
+static void
+json_string( FILE *fp, const char *s ) /* {{{ */
+{
+	putc( '"', fp );
+	for ( ; *s; s++ )
+	{
+		if ( *s == '"' || *s == '\\' )
+			fprintf( fp, "\\%c", *s );
+		else if ( (unsigned char) *s < 0x20 )
+			fprintf( fp, "\\u%04x", *s );
+		else
+			putc( *s, fp );
+	}
+	putc( '"', fp );
+} /* }}} */
+
+/*
+ * Worker pool. workers_run() hands out job numbers 0 .. jobs - 1 to the
+ * pool threads and to the calling thread, and returns once all of them
+ * are finished. A pool of one does everything in the calling thread.
+ */
+typedef void (*work_func_t)( void *arg, unsigned long int job );
+
+/* rows per job for row-parallel loops */
+#define ROWS_PER_JOB 16
+/* upper bound of -j */
+#define MAX_THREADS 1024
+
+typedef struct workers_s
+{
+	pthread_t *threads;
+	unsigned int count;
+	/* serializes workers_run() callers, e.g. several pipeline renderers */
+	pthread_mutex_t run;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+	/* current batch */
+	work_func_t func;
+	void *arg;
+	unsigned long int next;
+	unsigned long int jobs;
+	unsigned long int finished;
+	unsigned long int batch;
+	bool quit;
+} workers_t;
+
+/* takes jobs of the current batch until there are none left, lock held */
+static void
+workers_drain( workers_t *w ) /* {{{ */
+{
+	while ( w->next < w->jobs )
+	{
+		unsigned long int job = w->next++;
+		work_func_t func = w->func;
+		void *arg = w->arg;
+
+		pthread_mutex_unlock( &w->lock );
+		func( arg, job );
+		pthread_mutex_lock( &w->lock );
+
+		if ( ++w->finished == w->jobs )
+			pthread_cond_broadcast( &w->done );
+	}
+} /* }}} */
+
+static void *
+workers_thread( void *arg ) /* {{{ */
+{
+	workers_t *w = arg;
+	unsigned long int seen = 0;
+
+	pthread_mutex_lock( &w->lock );
+	while ( !w->quit )
+	{
+		if ( w->batch == seen )
+		{
+			pthread_cond_wait( &w->wake, &w->lock );
+			continue;
+		}
+		seen = w->batch;
+		workers_drain( w );
+	}
+	pthread_mutex_unlock( &w->lock );
+
+	return NULL;
+} /* }}} */
+
+static workers_t *
+workers_new( unsigned int count ) /* {{{ */
+{
+	workers_t *w;
+	unsigned int i;
+
+	w = calloc( 1, sizeof( workers_t ) );
+	if ( !w )
+		die( "Cannot allocate worker memory" );
+	w->count = count ? count : 1;
+	pthread_mutex_init( &w->run, NULL );
+	pthread_mutex_init( &w->lock, NULL );
+	pthread_cond_init( &w->wake, NULL );
+	pthread_cond_init( &w->done, NULL );
+
+	/* the calling thread is a worker as well */
+	w->threads = malloc( sizeof( pthread_t ) * w->count );
+	if ( !w->threads )
+		die( "Cannot allocate worker memory" );
+	for ( i = 1; i < w->count; i++ )
+	{
+		if ( pthread_create( w->threads + i, NULL, workers_thread, w ) )
+			die( "Cannot start worker thread %u", i );
+	}
+
+	return w;
+} /* }}} */
+
+static void
+workers_run( workers_t *w, work_func_t func, void *arg, unsigned long int jobs ) /* {{{ */
+{
+	unsigned long int i;
+
+	jmp_buf *jump = die_jump;
+
+	if ( !w || w->count == 1 )
+	{
+		for ( i = 0; i < jobs; i++ )
+			func( arg, i );
+		return;
+	}
+
+	pthread_mutex_lock( &w->run );
+	pthread_mutex_lock( &w->lock );
+	/* jumping out of here would leave the other threads running */
+	die_jump = NULL;
+	w->func = func;
+	w->arg = arg;
+	w->next = 0;
+	w->jobs = jobs;
+	w->finished = 0;
+	w->batch++;
+	pthread_cond_broadcast( &w->wake );
+
+	workers_drain( w );
+	while ( w->finished < w->jobs )
+		pthread_cond_wait( &w->done, &w->lock );
+	die_jump = jump;
+	pthread_mutex_unlock( &w->lock );
+	pthread_mutex_unlock( &w->run );
+} /* }}} */
+
+static void
+workers_destroy( workers_t **w ) /* {{{ */
+{
+	unsigned int i;
+
+	pthread_mutex_lock( &(*w)->lock );
+	(*w)->quit = true;
+	pthread_cond_broadcast( &(*w)->wake );
+	pthread_mutex_unlock( &(*w)->lock );
+
+	for ( i = 1; i < (*w)->count; i++ )
+		pthread_join( (*w)->threads[ i ], NULL );
+
+	pthread_mutex_destroy( &(*w)->run );
+	pthread_mutex_destroy( &(*w)->lock );
+	pthread_cond_destroy( &(*w)->wake );
+	pthread_cond_destroy( &(*w)->done );
+	free( (*w)->threads );
+	free( *w );
+	*w = NULL;
+} /* }}} */
+
+/* a png being read, see png_open_read() */
+typedef struct png_read_s
+{
+	FILE *fp;
 	png_structp png_ptr;
 	png_infop info_ptr;
-	png_bytepp row_pointers;
-	int tmp, y;
+} png_read_t;
 
-	image = malloc( sizeof( image_file_t ) );
+static void
+png_read_release( void *object ) /* {{{ */
+{
+	png_read_t *r = object;
+
+	if ( r->png_ptr )
+		png_destroy_read_struct( &r->png_ptr, r->info_ptr ? &r->info_ptr : NULL, NULL );
+	fclose( r->fp );
+} /* }}} */
+
+/* opens a png and sets it up to be read as 8-bit RGBA rows */
+static FILE *
+png_open_read( const char *filename,
+		png_structpp png_ptr_out, png_infopp info_ptr_out ) /* {{{ */
+{
+	unsigned char header[8];
+	png_read_t r = { NULL, NULL, NULL };
+	png_structp png_ptr;
+	png_infop info_ptr;
+	unsigned int mark;
+	int tmp;
 
 	FILE *fp = fopen( filename, "rb" );
 	if ( !fp )
 		die( "Cannot open file '%s'", filename );
+	r.fp = fp;
+	mark = die_hold( &r, png_read_release );
 
-	fread( header, 1, 8, fp );
-	if ( png_sig_cmp( header, 0, 8 ) )
+	if ( fread( header, 1, 8, fp ) != 8 || png_sig_cmp( header, 0, 8 ) )
 		die( "File '%s' is not a png", filename );
 
-	png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	png_ptr = r.png_ptr = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
 	if ( ! png_ptr )
 		die( "png_create_read_struct failed" );
 
-	info_ptr = png_create_info_struct( png_ptr );
+	info_ptr = r.info_ptr = png_create_info_struct( png_ptr );
 	if ( ! info_ptr )
 		die( "png_create_info_struct failed" );
 
@@ -161,9 +633,6 @@ image_file_t *image_from_file( const char *filename ) /* {{{ */
 	png_set_expand( png_ptr );
 	png_set_scale_16( png_ptr );
 
-	image->width = png_get_image_width( png_ptr, info_ptr );
-	image->height = png_get_image_height( png_ptr, info_ptr );
-
 	tmp = png_set_interlace_handling( png_ptr );
 
 	png_read_update_info( png_ptr, info_ptr );
@@ -175,170 +644,5718 @@ image_file_t *image_from_file( const char *filename ) /* {{{ */
 	tmp = png_get_bit_depth( png_ptr, info_ptr );
 	if ( tmp != BITS_PER_CHANNEL )
 		die( "Color depth is %d, but is should be %d", tmp, BITS_PER_CHANNEL );
-	
-	if ( setjmp( png_jmpbuf( png_ptr ) ) )
-	{
-		/* XXX: handle errors here */
-		die( "Error during image read" );
-	}
-
-	image->row_pointers = row_pointers =
-		malloc( sizeof(png_bytep) * image->height );
-	if ( !row_pointers )
-		die( "Cannot allocate pointer memory" );
-
-	for ( y = 0; y < image->height; y++ )
-	{
-		row_pointers[ y ] = malloc( image->width * BYTES_PER_PIXEL );
-		if ( !row_pointers[ y ] )
-			die( "Cannot allocate pointer memory for row %d", y );
-	}
-
-	png_read_image( png_ptr, row_pointers );
-	png_read_end( png_ptr, info_ptr );
-
-	fclose( fp );
-
-	png_destroy_read_struct( &png_ptr, &info_ptr, NULL );
 
-	return image;
+	die_unhold( mark );
+	*png_ptr_out = png_ptr;
+	*info_ptr_out = info_ptr;
+	return fp;
 } /* }}} */
 
-image_file_t *image_new( long unsigned int width, long unsigned int height ) /* {{{ */
+static png_bytepp
+image_rows_new( long unsigned int width, long unsigned int height, bool clear ) /* {{{ */
 {
 	long unsigned int y;
 	png_bytepp row_pointers;
-	image_file_t *image;
-
-	image = malloc( sizeof( image_file_t ) );
-	image->width = width;
-	image->height = height;
 
-	image->row_pointers = row_pointers =
-		malloc( sizeof(png_bytep) * image->height );
+	row_pointers = malloc( sizeof(png_bytep) * height );
 	if ( !row_pointers )
 		die( "Cannot allocate pointer memory" );
 
-	for ( y = 0; y < image->height; y++ )
+	for ( y = 0; y < height; y++ )
 	{
-		row_pointers[ y ] = calloc( BYTES_PER_PIXEL, image->width );
+		row_pointers[ y ] = clear ? calloc( BYTES_PER_PIXEL, width )
+			: malloc( width * BYTES_PER_PIXEL );
 		if ( !row_pointers[ y ] )
-			die( "Cannot allocate pointer memory for row %d", y );
+			die( "Cannot allocate pointer memory for row %lu", y );
 	}
 
-	return image;
+	return row_pointers;
 } /* }}} */
 
-void image_write( image_file_t * restrict image, const char * restrict filename ) /* {{{ */
+void image_destroy( image_file_t **image ) /* {{{ */
 {
-	FILE *fp;
-	png_structp png_ptr;
-	png_infop info_ptr;
-
-	fp = fopen( filename, "wb" );
-	if ( !fp )
-	{
-		die( "Could not open file %s for writing", filename );
-	}
+	long unsigned int y;
+	png_bytepp row_pointers = (*image)->row_pointers;
 
-	png_ptr = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
-	if ( ! png_ptr )
-		die( "png_create_write_struct failed" );
+	for ( y = 0; y < (*image)->height; y++ )
+		free( row_pointers[ y ] );
+	free( row_pointers );
 
-	info_ptr = png_create_info_struct( png_ptr );
-	if ( ! info_ptr )
-		die( "png_create_info_struct failed" );
+	free( *image );
+	*image = NULL;
+} /* }}} */
 
-	if ( setjmp( png_jmpbuf( png_ptr ) ) )
-	{
-		/* XXX: handle errors here */
-		die( "Error during png writing" );
-	}
+/* die_hold() release of an image_file_t pointer, which may be NULL */
+static void
+image_release( void *slot )
+{
+	image_file_t **image = slot;
+	if ( *image )
+		image_destroy( image );
+}
 
-	png_init_io( png_ptr, fp );
-	png_set_IHDR( png_ptr, info_ptr, image->width, image->height,
-			BITS_PER_CHANNEL, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-			PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE );
+/* see image_from_file() for other formats */
+image_file_t *image_from_png( const char *filename ) /* {{{ */
+{
+	image_file_t *image;
+	png_read_t r;
+	unsigned int mark;
 
-	png_write_info( png_ptr, info_ptr );
+	r.fp = png_open_read( filename, &r.png_ptr, &r.info_ptr );
+	mark = die_hold( &r, png_read_release );
 
-	png_write_image( png_ptr, image->row_pointers );
+	image = malloc( sizeof( image_file_t ) );
+	if ( !image )
+		die( "Cannot allocate image memory" );
+	image->width = png_get_image_width( r.png_ptr, r.info_ptr );
+	image->height = png_get_image_height( r.png_ptr, r.info_ptr );
+	image->row_pointers = image_rows_new( image->width, image->height, false );
+	die_hold( &image, image_release );
+
+	if ( setjmp( png_jmpbuf( r.png_ptr ) ) )
+	{
+		die( "Error during image read" );
+	}
 
-	png_write_end( png_ptr, NULL );
+	png_read_image( r.png_ptr, image->row_pointers );
+	png_read_end( r.png_ptr, r.info_ptr );
 
-	png_destroy_write_struct( &png_ptr, &info_ptr );
+	die_unhold( mark );
+	png_read_release( &r );
 
-	fclose( fp );
+	return image;
 } /* }}} */
 
-void image_destroy( image_file_t **image ) /* {{{ */
+image_file_t *image_new( long unsigned int width, long unsigned int height ) /* {{{ */
 {
-	long unsigned int y;
-	png_bytepp row_pointers = (*image)->row_pointers;
+	image_file_t *image;
 
-	for ( y = 0; y < (*image)->height; y++ )
-		free( row_pointers[ y ] );
-	free( row_pointers );
+	image = malloc( sizeof( image_file_t ) );
+	image->width = width;
+	image->height = height;
+	image->row_pointers = image_rows_new( width, height, true );
 
-	free( *image );
-	*image = NULL;
+	return image;
 } /* }}} */
 
-static double
-coord_dist( const coord_t * restrict a, const coord_t * restrict b )
+/*
+ * Output post-processing. Everything happens row by row while the image is
+ * written, so it works with streamed rendering as well.
+ */
+typedef struct output_opts_s
 {
-	double x = b->x - a->x;
-	double y = b->y - a->y;
-	return sqrt( x * x + y * y );
-}
+	/*
+	 * Composited with Multiply under the rendered image, which is cropped
+	 * to the background size, like "convert BG IMG -compose Multiply
+	 * -composite". Decoded once and shared by all images.
+	 */
+	const image_file_t *background;
+	/* box scaled to fit into fit_width x fit_height keeping aspect, 0 keeps size */
+	unsigned long int fit_width;
+	unsigned long int fit_height;
+	/* zlib level and PNG_FILTER_* mask, -1 keeps libpng defaults */
+	int png_level;
+	int png_filters;
+	/* write only the rendered box, PNGs get its offset in an oFFs chunk */
+	bool crop;
+} output_opts_t;
+
+/* like ImageMagick without a quality setting */
+#define JPEG_QUALITY 92
+
+/* outputs are picked by extension, inputs by their magic */
+typedef enum
+{
+	FORMAT_PNG,
+	FORMAT_JPEG,
+	/* raw 8-bit RGB_ALPHA netpbm, for intermediates */
+	FORMAT_PAM,
+	FORMAT_QOI,
+} image_format_t;
+
+/* {{{ QOI, see https://qoiformat.org/qoi-specification.pdf */
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK 0xc0
+#define QOI_HEADER_SIZE 14
+#define QOI_HASH( p ) ( ( (p).r * 3 + (p).g * 5 + (p).b * 7 + (p).a * 11 ) % 64 )
+
+/* codec state carried from row to row */
+typedef struct qoi_state_s
+{
+	pixel_rgba_t index[ 64 ];
+	pixel_rgba_t prev;
+	unsigned int run;
+} qoi_state_t;
 
-static inline coord_t
-coord_subst( const coord_t * restrict a, const coord_t * restrict b )
+static void
+qoi_init( qoi_state_t *q )
 {
-	coord_t output;
-	output.x = a->x - b->x;
-	output.y = a->y - b->y;
-	return output;
+	memset( q, 0, sizeof( qoi_state_t ) );
+	q->prev.a = 255;
 }
 
-static inline coord_t
-coord_add( const coord_t * restrict a, const coord_t * restrict b )
+static inline bool
+pixel_equal( pixel_rgba_t a, pixel_rgba_t b )
 {
-	coord_t output;
-	output.x = a->x + b->x;
-	output.y = a->y + b->y;
-	return output;
+	return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
 }
 
-static inline coord_t
-coord_scale( const coord_t * restrict a, double mult )
+/* encodes n pixels into buf, at most 5 bytes per pixel, returns the length */
+static size_t
+qoi_encode_row( qoi_state_t *q, const pixel_rgba_t *row, unsigned long int n,
+		png_bytep buf ) /* {{{ */
 {
-	coord_t output;
-	output.x = a->x * mult;
-	output.y = a->y * mult;
-	return output;
+	png_bytep o = buf;
+	unsigned long int x;
+
+	for ( x = 0; x < n; x++ )
+	{
+		pixel_rgba_t px = row[ x ];
+		unsigned int h;
+
+		if ( pixel_equal( px, q->prev ) )
+		{
+			if ( ++q->run == 62 )
+			{
+				*o++ = QOI_OP_RUN | ( q->run - 1 );
+				q->run = 0;
+			}
+			continue;
+		}
+		if ( q->run )
+		{
+			*o++ = QOI_OP_RUN | ( q->run - 1 );
+			q->run = 0;
+		}
+
+		h = QOI_HASH( px );
+		if ( pixel_equal( q->index[ h ], px ) )
+		{
+			*o++ = QOI_OP_INDEX | h;
+		}
+		else
+		{
+			q->index[ h ] = px;
+			if ( px.a == q->prev.a )
+			{
+				signed char vr = px.r - q->prev.r;
+				signed char vg = px.g - q->prev.g;
+				signed char vb = px.b - q->prev.b;
+				signed char vg_r = vr - vg;
+				signed char vg_b = vb - vg;
+
+				if ( vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2 )
+				{
+					*o++ = QOI_OP_DIFF | ( vr + 2 ) << 4 | ( vg + 2 ) << 2 | ( vb + 2 );
+				}
+				else if ( vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32
+						&& vg_b > -9 && vg_b < 8 )
+				{
+					*o++ = QOI_OP_LUMA | ( vg + 32 );
+					*o++ = ( vg_r + 8 ) << 4 | ( vg_b + 8 );
+				}
+				else
+				{
+					*o++ = QOI_OP_RGB;
+					*o++ = px.r;
+					*o++ = px.g;
+					*o++ = px.b;
+				}
+			}
+			else
+			{
+				*o++ = QOI_OP_RGBA;
+				*o++ = px.r;
+				*o++ = px.g;
+				*o++ = px.b;
+				*o++ = px.a;
+			}
+		}
+		q->prev = px;
+	}
+
+	return o - buf;
+} /* }}} */
+
+/* decodes n pixels from fp */
+static void
+qoi_decode_row( qoi_state_t *q, FILE *fp, pixel_rgba_t *row, unsigned long int n ) /* {{{ */
+{
+	pixel_rgba_t px = q->prev;
+	unsigned long int x;
+
+	for ( x = 0; x < n; x++ )
+	{
+		if ( q->run )
+		{
+			q->run--;
+		}
+		else
+		{
+			int b1 = getc_unlocked( fp ), b2;
+			if ( b1 == EOF )
+				die( "Unexpected end of qoi data" );
+			if ( b1 == QOI_OP_RGB )
+			{
+				px.r = getc_unlocked( fp );
+				px.g = getc_unlocked( fp );
+				px.b = getc_unlocked( fp );
+				if ( feof( fp ) || ferror( fp ) )
+					die( "Unexpected end of qoi data" );
+			}
+			else if ( b1 == QOI_OP_RGBA )
+			{
+				px.r = getc_unlocked( fp );
+				px.g = getc_unlocked( fp );
+				px.b = getc_unlocked( fp );
+				px.a = getc_unlocked( fp );
+				if ( feof( fp ) || ferror( fp ) )
+					die( "Unexpected end of qoi data" );
+			}
+			else if ( ( b1 & QOI_MASK ) == QOI_OP_INDEX )
+			{
+				px = q->index[ b1 ];
+			}
+			else if ( ( b1 & QOI_MASK ) == QOI_OP_DIFF )
+			{
+				px.r += ( ( b1 >> 4 ) & 0x03 ) - 2;
+				px.g += ( ( b1 >> 2 ) & 0x03 ) - 2;
+				px.b += ( b1 & 0x03 ) - 2;
+			}
+			else if ( ( b1 & QOI_MASK ) == QOI_OP_LUMA )
+			{
+				int vg = ( b1 & 0x3f ) - 32;
+				b2 = getc_unlocked( fp );
+				if ( b2 == EOF )
+					die( "Unexpected end of qoi data" );
+				px.r += vg - 8 + ( ( b2 >> 4 ) & 0x0f );
+				px.g += vg;
+				px.b += vg - 8 + ( b2 & 0x0f );
+			}
+			else
+			{
+				q->run = b1 & 0x3f;
+			}
+			q->index[ QOI_HASH( px ) ] = px;
+		}
+		row[ x ] = px;
+	}
+	q->prev = px;
+} /* }}} */
+
+/* }}} */
+
+/* image written row by row, see image_write() for whole images */
+typedef struct image_output_s
+{
+	image_format_t format;
+	FILE *fp;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	struct jpeg_compress_struct jpeg;
+	struct jpeg_error_mgr jpeg_err;
+	qoi_state_t qoi;
+	png_bytep qoi_buf;
+	int png_level;
+	int png_filters;
+
+	const image_file_t *background;
+	/* canvas, image_output_row() gets the rows of box on it */
+	long unsigned int in_width;
+	long unsigned int in_height;
+	long unsigned int in_y;
+	image_box_t box;
+	/* canvas row, zero outside of the box */
+	pixel_rgba_t *pad;
+	/* cropped outputs, where the box was */
+	long unsigned int off_x;
+	long unsigned int off_y;
+	/* composited image */
+	long unsigned int width;
+	long unsigned int height;
+	long unsigned int y;
+	pixel_rgba_t *comp;
+	/* scaled image, sums of premultiplied rows for the current output row */
+	long unsigned int out_width;
+	long unsigned int out_height;
+	long unsigned int out_y;
+	double *hsum;
+	double *vsum;
+	png_bytep row;
+	/* part of the scaled image which is encoded, all of it unless cropped */
+	image_box_t window;
+} image_output_t;
+
+static void
+jpeg_die( j_common_ptr cinfo ) /* {{{ */
+{
+	char msg[ JMSG_LENGTH_MAX ];
+
+	(*cinfo->err->format_message)( cinfo, msg );
+	die( "Error during jpeg processing: %s", msg );
+} /* }}} */
+
+static void
+jpeg_release( void *cinfo )
+{
+	jpeg_destroy( cinfo );
+}
+
+static image_format_t
+image_format_from_name( const char *filename ) /* {{{ */
+{
+	const char *ext = strrchr( filename, '.' );
+
+	if ( ext && ( !strcasecmp( ext, ".jpg" ) || !strcasecmp( ext, ".jpeg" ) ) )
+		return FORMAT_JPEG;
+	if ( ext && !strcasecmp( ext, ".pam" ) )
+		return FORMAT_PAM;
+	if ( ext && !strcasecmp( ext, ".qoi" ) )
+		return FORMAT_QOI;
+	return FORMAT_PNG;
+} /* }}} */
+
+static void
+put_be32( png_bytep p, uint32_t v )
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+image_output_start( image_output_t *out ) /* {{{ */
+{
+	if ( out->format == FORMAT_PAM )
+	{
+		fprintf( out->fp, "P7\nWIDTH %lu\nHEIGHT %lu\nDEPTH 4\nMAXVAL 255\n"
+				"TUPLTYPE RGB_ALPHA\nENDHDR\n", out->window.width, out->window.height );
+		return;
+	}
+	if ( out->format == FORMAT_QOI )
+	{
+		png_byte header[ QOI_HEADER_SIZE ] = { 'q', 'o', 'i', 'f' };
+		put_be32( header + 4, out->window.width );
+		put_be32( header + 8, out->window.height );
+		header[ 12 ] = 4; /* RGBA */
+		header[ 13 ] = 0; /* sRGB */
+		fwrite( header, 1, sizeof( header ), out->fp );
+		qoi_init( &out->qoi );
+		out->qoi_buf = malloc( 5 * out->window.width + 1 );
+		if ( !out->qoi_buf )
+			die( "Cannot allocate output memory" );
+		return;
+	}
+	if ( out->format == FORMAT_JPEG )
+	{
+		out->jpeg.err = jpeg_std_error( &out->jpeg_err );
+		out->jpeg_err.error_exit = jpeg_die;
+		jpeg_create_compress( &out->jpeg );
+		jpeg_stdio_dest( &out->jpeg, out->fp );
+		out->jpeg.image_width = out->window.width;
+		out->jpeg.image_height = out->window.height;
+		out->jpeg.input_components = 3;
+		out->jpeg.in_color_space = JCS_RGB;
+		jpeg_set_defaults( &out->jpeg );
+		jpeg_set_quality( &out->jpeg, JPEG_QUALITY, TRUE );
+		jpeg_start_compress( &out->jpeg, TRUE );
+		return;
+	}
+
+	out->png_ptr = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	if ( ! out->png_ptr )
+		die( "png_create_write_struct failed" );
+
+	out->info_ptr = png_create_info_struct( out->png_ptr );
+	if ( ! out->info_ptr )
+		die( "png_create_info_struct failed" );
+
+	if ( setjmp( png_jmpbuf( out->png_ptr ) ) )
+	{
+		/* XXX: handle errors here */
+		die( "Error during png writing" );
+	}
+
+	png_init_io( out->png_ptr, out->fp );
+	if ( out->png_level >= 0 )
+		png_set_compression_level( out->png_ptr, out->png_level );
+	if ( out->png_filters >= 0 )
+		png_set_filter( out->png_ptr, PNG_FILTER_TYPE_BASE, out->png_filters );
+	png_set_IHDR( out->png_ptr, out->info_ptr, out->window.width, out->window.height,
+			BITS_PER_CHANNEL, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+			PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE );
+	if ( out->off_x || out->off_y )
+		png_set_oFFs( out->png_ptr, out->info_ptr, out->off_x, out->off_y,
+				PNG_OFFSET_PIXEL );
+
+	png_write_info( out->png_ptr, out->info_ptr );
+} /* }}} */
+
+/* encodes one final RGBA row */
+static void
+image_output_encode( image_output_t *out, const pixel_rgba_t *row ) /* {{{ */
+{
+	long unsigned int x;
+
+	if ( out->format == FORMAT_PAM )
+	{
+		if ( fwrite( row, sizeof( pixel_rgba_t ), out->window.width, out->fp ) != out->window.width )
+			die( "Error during pam writing" );
+		return;
+	}
+	if ( out->format == FORMAT_QOI )
+	{
+		size_t len = qoi_encode_row( &out->qoi, row, out->window.width, out->qoi_buf );
+		if ( fwrite( out->qoi_buf, 1, len, out->fp ) != len )
+			die( "Error during qoi writing" );
+		return;
+	}
+	if ( out->format == FORMAT_JPEG )
+	{
+		JSAMPROW rgb = out->row;
+		for ( x = 0; x < out->window.width; x++ )
+		{
+			rgb[ 3 * x ] = row[ x ].r;
+			rgb[ 3 * x + 1 ] = row[ x ].g;
+			rgb[ 3 * x + 2 ] = row[ x ].b;
+		}
+		jpeg_write_scanlines( &out->jpeg, &rgb, 1 );
+		return;
+	}
+
+	if ( setjmp( png_jmpbuf( out->png_ptr ) ) )
+	{
+		die( "Error during png writing" );
+	}
+
+	png_write_row( out->png_ptr, (png_const_bytep) row );
+} /* }}} */
+
+/*
+ * Box scaling: source pixel x covers [ x * out_width, ( x + 1 ) * out_width )
+ * and output pixel ox covers [ ox * width, ( ox + 1 ) * width ), so every
+ * output pixel gets exactly width * height of integer overlap weight.
+ */
+static void
+image_output_scale( image_output_t *out, const pixel_rgba_t *row ) /* {{{ */
+{
+	uint64_t w = out->width, ow = out->out_width;
+	uint64_t h = out->height, oh = out->out_height;
+	uint64_t x, ox, y = out->y;
+	/* only the window's columns are summed */
+	uint64_t ox_start = out->window.x, ox_stop = out->window.x + out->window.width;
+
+	for ( ox = ox_start, x = 0; ox < ox_stop; ox++ )
+	{
+		double *hs = out->hsum + 4 * ox;
+		hs[0] = hs[1] = hs[2] = hs[3] = 0;
+		for ( x = ox * w / ow; x < w && x * ow < ( ox + 1 ) * w; x++ )
+		{
+			uint64_t start = x * ow > ox * w ? x * ow : ox * w;
+			uint64_t stop = ( x + 1 ) * ow < ( ox + 1 ) * w ? ( x + 1 ) * ow : ( ox + 1 ) * w;
+			double weight = (double) ( stop - start ) * row[ x ].a;
+			hs[0] += weight * row[ x ].r;
+			hs[1] += weight * row[ x ].g;
+			hs[2] += weight * row[ x ].b;
+			hs[3] += weight;
+		}
+	}
+
+	while ( out->out_y < oh )
+	{
+		uint64_t oy = out->out_y;
+		uint64_t start = y * oh > oy * h ? y * oh : oy * h;
+		uint64_t stop = ( y + 1 ) * oh < ( oy + 1 ) * h ? ( y + 1 ) * oh : ( oy + 1 ) * h;
+		if ( stop > start )
+		{
+			for ( ox = 4 * ox_start; ox < 4 * ox_stop; ox++ )
+				out->vsum[ ox ] += (double) ( stop - start ) * out->hsum[ ox ];
+		}
+		if ( ( oy + 1 ) * h > ( y + 1 ) * oh )
+			break;
+
+		/* output row complete */
+		pixel_rgba_t *p = (pixel_rgba_t *) out->row;
+		double area = (double) w * h;
+		for ( ox = ox_start; ox < ox_stop; ox++ )
+		{
+			double *vs = out->vsum + 4 * ox;
+			double alpha = vs[3];
+			if ( alpha > 0 )
+			{
+				p[ ox ].r = vs[0] / alpha + 0.5;
+				p[ ox ].g = vs[1] / alpha + 0.5;
+				p[ ox ].b = vs[2] / alpha + 0.5;
+				p[ ox ].a = alpha / area + 0.5;
+			}
+			else
+			{
+				p[ ox ].r = p[ ox ].g = p[ ox ].b = p[ ox ].a = 0;
+			}
+			vs[0] = vs[1] = vs[2] = vs[3] = 0;
+		}
+		/* jpeg packs rgb into the same buffer, front to back, which is safe */
+		if ( oy >= out->window.y && oy < out->window.y + out->window.height )
+			image_output_encode( out, p + ox_start );
+		out->out_y++;
+	}
+} /* }}} */
+
+/* whole image scaled to width x height, weighted like image_output_scale() */
+static image_file_t *
+image_scale( const image_file_t *image, long unsigned int width,
+		long unsigned int height ) /* {{{ */
+{
+	uint64_t w = image->width, ow = width;
+	uint64_t h = image->height, oh = height;
+	uint64_t x, ox, y, oy;
+	image_file_t *scaled = image_new( width, height );
+	double *sum = malloc( 4 * sizeof( double ) * ow );
+
+	if ( !sum )
+		die( "Cannot allocate scaling memory" );
+
+	for ( oy = 0; oy < oh; oy++ )
+	{
+		pixel_rgba_t *p = (pixel_rgba_t *) scaled->row_pointers[ oy ];
+		double area = (double) w * h;
+
+		memset( sum, 0, 4 * sizeof( double ) * ow );
+		for ( y = oy * h / oh; y < h && y * oh < ( oy + 1 ) * h; y++ )
+		{
+			const pixel_rgba_t *row = (const pixel_rgba_t *) image->row_pointers[ y ];
+			uint64_t y_start = y * oh > oy * h ? y * oh : oy * h;
+			uint64_t y_stop = ( y + 1 ) * oh < ( oy + 1 ) * h ? ( y + 1 ) * oh : ( oy + 1 ) * h;
+
+			for ( ox = 0; ox < ow; ox++ )
+			{
+				double *s = sum + 4 * ox;
+				for ( x = ox * w / ow; x < w && x * ow < ( ox + 1 ) * w; x++ )
+				{
+					uint64_t start = x * ow > ox * w ? x * ow : ox * w;
+					uint64_t stop = ( x + 1 ) * ow < ( ox + 1 ) * w ? ( x + 1 ) * ow : ( ox + 1 ) * w;
+					double weight = (double) ( stop - start ) * ( y_stop - y_start ) * row[ x ].a;
+					s[0] += weight * row[ x ].r;
+					s[1] += weight * row[ x ].g;
+					s[2] += weight * row[ x ].b;
+					s[3] += weight;
+				}
+			}
+		}
+
+		for ( ox = 0; ox < ow; ox++ )
+		{
+			double *s = sum + 4 * ox;
+			if ( s[3] > 0 )
+			{
+				p[ ox ].r = s[0] / s[3] + 0.5;
+				p[ ox ].g = s[1] / s[3] + 0.5;
+				p[ ox ].b = s[2] / s[3] + 0.5;
+				p[ ox ].a = s[3] / area + 0.5;
+			}
+		}
+	}
+	free( sum );
+
+	return scaled;
+} /* }}} */
+
+/* passes one composited row on */
+static void
+image_output_composed( image_output_t *out, const pixel_rgba_t *row ) /* {{{ */
+{
+	if ( out->y >= out->height )
+		return;
+	if ( out->width == out->out_width && out->height == out->out_height )
+	{
+		if ( out->y >= out->window.y && out->y < out->window.y + out->window.height )
+			image_output_encode( out, row + out->window.x );
+	}
+	else
+		image_output_scale( out, row );
+	out->y++;
+} /* }}} */
+
+/* Multiply in premultiplied form: Sca * Dca + Sca * ( 1 - Da ) + Dca * ( 1 - Sa ) */
+static inline png_byte
+multiply_channel( png_byte s, double sa, png_byte d, double da, double ra )
+{
+	double sca = s / 255.0 * sa;
+	double dca = d / 255.0 * da;
+	return ( sca * dca + sca * ( 1 - da ) + dca * ( 1 - sa ) ) / ra * 255.0 + 0.5;
 }
 
-static inline coord_t
-coord_middle( const coord_t * restrict a, const coord_t * restrict b )
+static void
+image_output_multiply( image_output_t *out, const pixel_rgba_t *row ) /* {{{ */
+{
+	const pixel_rgba_t *bg = (const pixel_rgba_t *) out->background->row_pointers[ out->y ];
+	long unsigned int x;
+
+	for ( x = 0; x < out->width; x++ )
+	{
+		const pixel_rgba_t *d = bg + x;
+		const pixel_rgba_t *s;
+		pixel_rgba_t *p = out->comp + x;
+		double sa, da, ra;
+		/* row is a box row */
+		if ( !row || x < out->box.x || x >= out->box.x + out->box.width
+				|| x >= out->in_width || !row[ x - out->box.x ].a )
+		{
+			*p = *d;
+			continue;
+		}
+		s = row + x - out->box.x;
+		sa = s->a / 255.0;
+		da = d->a / 255.0;
+		ra = sa + da - sa * da;
+
+		p->r = multiply_channel( s->r, sa, d->r, da, ra );
+		p->g = multiply_channel( s->g, sa, d->g, da, ra );
+		p->b = multiply_channel( s->b, sa, d->b, da, ra );
+		p->a = ra * 255.0 + 0.5;
+	}
+
+	image_output_composed( out, out->comp );
+} /* }}} */
+
+/* die_hold() release of an output which was not closed */
+static void
+image_output_release( void *object ) /* {{{ */
+{
+	image_output_t *o = object;
+
+	if ( o->png_ptr )
+		png_destroy_write_struct( &o->png_ptr, &o->info_ptr );
+	/* a no-op unless jpeg_create_compress() ran on the zeroed struct */
+	jpeg_destroy( (j_common_ptr) &o->jpeg );
+	if ( o->fp )
+		fclose( o->fp );
+	free( o->qoi_buf );
+	free( o->comp );
+	free( o->pad );
+	free( o->row );
+	free( o->hsum );
+	free( o->vsum );
+	free( o );
+} /* }}} */
+
+/*
+ * Output of a width x height canvas, rows passed to image_output_row() cover
+ * only box (the whole canvas if NULL), everything else is transparent.
+ */
+static image_output_t *
+image_output_open( const char *filename, long unsigned int width,
+		long unsigned int height, const image_box_t *box,
+		const output_opts_t *oo ) /* {{{ */
+{
+	image_output_t *out;
+	long unsigned int canvas_width = width;
+	long unsigned int canvas_height = height;
+	double fit = 1.0;
+	unsigned int mark;
+
+	out = calloc( 1, sizeof( image_output_t ) );
+	if ( !out )
+		die( "Cannot allocate output memory" );
+	mark = die_hold( out, image_output_release );
+
+	out->format = image_format_from_name( filename );
+	out->png_level = oo ? oo->png_level : -1;
+	out->png_filters = oo ? oo->png_filters : -1;
+	if ( box )
+	{
+		out->box = *box;
+	}
+	else
+	{
+		out->box.width = width;
+		out->box.height = height;
+	}
+	out->background = oo ? oo->background : NULL;
+	if ( out->background )
+	{
+		canvas_width = out->background->width;
+		canvas_height = out->background->height;
+	}
+	if ( oo && oo->fit_width && oo->fit_height )
+	{
+		/* same rounding as ImageMagick geometry */
+		double fx = (double) oo->fit_width / canvas_width;
+		double fy = (double) oo->fit_height / canvas_height;
+		fit = fx < fy ? fx : fy;
+	}
+
+	if ( oo && oo->crop && fit == 1.0 )
+	{
+		out->off_x = out->box.x;
+		out->off_y = out->box.y;
+		out->box.x = out->box.y = 0;
+		width = out->box.width;
+		height = out->box.height;
+	}
+	out->in_width = width;
+	out->in_height = height;
+	if ( out->background )
+	{
+		width = out->background->width;
+		height = out->background->height;
+	}
+	out->width = out->out_width = width;
+	out->height = out->out_height = height;
+
+	if ( fit != 1.0 )
+	{
+		out->out_width = floor( width * fit + 0.5 );
+		out->out_height = floor( height * fit + 0.5 );
+		if ( !out->out_width )
+			out->out_width = 1;
+		if ( !out->out_height )
+			out->out_height = 1;
+	}
+	out->window.width = out->out_width;
+	out->window.height = out->out_height;
+	if ( oo && oo->crop && fit != 1.0 )
+	{
+		/*
+		 * The whole canvas is scaled, so the crop matches the fitted
+		 * canvas pixel for pixel; only scaled pixels overlapping the box
+		 * are encoded.
+		 */
+		uint64_t w = width, ow = out->out_width;
+		uint64_t h = height, oh = out->out_height;
+		out->window.x = out->box.x * ow / w;
+		out->window.y = out->box.y * oh / h;
+		out->window.width = ( ( out->box.x + out->box.width ) * ow + w - 1 ) / w
+				- out->window.x;
+		out->window.height = ( ( out->box.y + out->box.height ) * oh + h - 1 ) / h
+				- out->window.y;
+		out->off_x = out->window.x;
+		out->off_y = out->window.y;
+	}
+
+	out->comp = malloc( sizeof( pixel_rgba_t ) * out->width );
+	out->pad = calloc( sizeof( pixel_rgba_t ), out->in_width );
+	out->row = malloc( sizeof( pixel_rgba_t ) * out->out_width );
+	out->hsum = calloc( 4 * sizeof( double ), out->out_width );
+	out->vsum = calloc( 4 * sizeof( double ), out->out_width );
+	if ( !out->comp || !out->pad || !out->row || !out->hsum || !out->vsum )
+		die( "Cannot allocate output memory" );
+
+	out->fp = fopen( filename, "wb" );
+	if ( !out->fp )
+	{
+		die( "Could not open file %s for writing", filename );
+	}
+
+	image_output_start( out );
+	die_unhold( mark );
+
+	return out;
+} /* }}} */
+
+/* passes canvas row in_y on, row covers the box or is NULL past it */
+static void
+image_output_canvas_row( image_output_t *out, const pixel_rgba_t *row ) /* {{{ */
+{
+	if ( out->background )
+	{
+		if ( out->in_y < out->height )
+			image_output_multiply( out, row );
+	}
+	else if ( row && out->box.width == out->in_width )
+	{
+		image_output_composed( out, row );
+	}
+	else
+	{
+		/* pad stays transparent outside of the box */
+		if ( row )
+			memcpy( out->pad + out->box.x, row, sizeof( pixel_rgba_t ) * out->box.width );
+		else
+			memset( out->pad + out->box.x, 0, sizeof( pixel_rgba_t ) * out->box.width );
+		image_output_composed( out, out->pad );
+	}
+	out->in_y++;
+} /* }}} */
+
+/* next row of the box */
+static void
+image_output_row( image_output_t *out, const png_byte *row ) /* {{{ */
+{
+	while ( out->in_y < out->box.y )
+		image_output_canvas_row( out, NULL );
+	image_output_canvas_row( out, (const pixel_rgba_t *) row );
+} /* }}} */
+
+static void
+image_output_close( image_output_t **out ) /* {{{ */
+{
+	image_output_t *o = *out;
+	FILE *fp;
+
+	/* canvas rows below the box */
+	while ( o->in_y < o->in_height )
+		image_output_canvas_row( o, NULL );
+	/* background rows below the rendered image */
+	while ( o->background && o->y < o->height )
+		image_output_multiply( o, NULL );
+
+	if ( o->format == FORMAT_QOI )
+	{
+		static const png_byte end[ 8 ] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+		size_t len = 0;
+		if ( o->qoi.run )
+			o->qoi_buf[ len++ ] = QOI_OP_RUN | ( o->qoi.run - 1 );
+		fwrite( o->qoi_buf, 1, len, o->fp );
+		fwrite( end, 1, sizeof( end ), o->fp );
+		free( o->qoi_buf );
+		o->qoi_buf = NULL;
+	}
+	else if ( o->format == FORMAT_JPEG )
+	{
+		jpeg_finish_compress( &o->jpeg );
+		jpeg_destroy_compress( &o->jpeg );
+	}
+	else if ( o->format == FORMAT_PNG )
+	{
+		if ( setjmp( png_jmpbuf( o->png_ptr ) ) )
+		{
+			die( "Error during png writing" );
+		}
+
+		png_write_end( o->png_ptr, NULL );
+
+		png_destroy_write_struct( &o->png_ptr, &o->info_ptr );
+	}
+
+	/* the last buffered pam and qoi bytes only fail here, on a full disk */
+	fp = o->fp;
+	o->fp = NULL;
+	if ( ferror( fp ) | fclose( fp ) )
+		die( "Cannot write output file" );
+	free( o->comp );
+	free( o->pad );
+	free( o->row );
+	free( o->hsum );
+	free( o->vsum );
+	free( o );
+	*out = NULL;
+} /* }}} */
+
+/* jpeg decoded to the same RGBA rows as image_from_file(), for backgrounds */
+image_file_t *image_from_jpeg( const char *filename ) /* {{{ */
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	image_file_t *image;
+	JSAMPROW rgb;
+	long unsigned int x, y;
+	unsigned int mark;
+	FILE *fp;
+
+	fp = fopen( filename, "rb" );
+	if ( !fp )
+		die( "Cannot open file '%s'", filename );
+	mark = die_hold( fp, file_release );
+
+	/* jpeg_die() never returns to libjpeg, it aborts or jumps to die_jump */
+	cinfo.err = jpeg_std_error( &jerr );
+	jerr.error_exit = jpeg_die;
+	jpeg_create_decompress( &cinfo );
+	die_hold( &cinfo, jpeg_release );
+	jpeg_stdio_src( &cinfo, fp );
+	jpeg_read_header( &cinfo, TRUE );
+	cinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress( &cinfo );
+
+	image = malloc( sizeof( image_file_t ) );
+	if ( !image )
+		die( "Cannot allocate image memory" );
+	image->width = cinfo.output_width;
+	image->height = cinfo.output_height;
+	image->row_pointers = image_rows_new( image->width, image->height, false );
+	die_hold( &image, image_release );
+
+	/* expand rgb in place, back to front */
+	for ( y = 0; y < image->height; y++ )
+	{
+		rgb = image->row_pointers[ y ];
+		jpeg_read_scanlines( &cinfo, &rgb, 1 );
+		for ( x = image->width; x-- > 0; )
+		{
+			rgb[ 4 * x + 3 ] = 255;
+			rgb[ 4 * x + 2 ] = rgb[ 3 * x + 2 ];
+			rgb[ 4 * x + 1 ] = rgb[ 3 * x + 1 ];
+			rgb[ 4 * x ] = rgb[ 3 * x ];
+		}
+	}
+
+	jpeg_finish_decompress( &cinfo );
+	die_unhold( mark );
+	jpeg_destroy_decompress( &cinfo );
+	fclose( fp );
+
+	return image;
+} /* }}} */
+
+/* image is the box of a width x height canvas, see image_output_open() */
+void image_write_box( image_file_t * restrict image, const char * restrict filename,
+		long unsigned int width, long unsigned int height, const image_box_t *box,
+		const output_opts_t *oo ) /* {{{ */
+{
+	image_output_t *out;
+	long unsigned int y;
+	unsigned int mark;
+
+	out = image_output_open( filename, width, height, box, oo );
+	mark = die_hold( out, image_output_release );
+	for ( y = 0; y < image->height; y++ )
+		image_output_row( out, image->row_pointers[ y ] );
+	image_output_close( &out );
+	die_unhold( mark );
+} /* }}} */
+
+void image_write( image_file_t * restrict image, const char * restrict filename,
+		const output_opts_t *oo ) /* {{{ */
+{
+	image_write_box( image, filename, image->width, image->height, NULL, oo );
+} /* }}} */
+
+/* sniffs the first bytes of a file */
+static image_format_t
+image_format_from_magic( const char *filename ) /* {{{ */
+{
+	unsigned char magic[4];
+	size_t got;
+	FILE *fp = fopen( filename, "rb" );
+	if ( !fp )
+		die( "Cannot open file '%s'", filename );
+	got = fread( magic, 1, sizeof( magic ), fp );
+	fclose( fp );
+
+	/* png_open_read() complains about anything unknown */
+	if ( got != sizeof( magic ) )
+		return FORMAT_PNG;
+	if ( !memcmp( magic, "qoif", 4 ) )
+		return FORMAT_QOI;
+	if ( !memcmp( magic, "P7\n", 3 ) )
+		return FORMAT_PAM;
+	if ( magic[0] == 0xff && magic[1] == 0xd8 && magic[2] == 0xff )
+		return FORMAT_JPEG;
+	return FORMAT_PNG;
+} /* }}} */
+
+/* run of pixels start .. stop - 1 with non-zero alpha */
+typedef struct pixel_span_s
+{
+	uint32_t start;
+	uint32_t stop;
+} pixel_span_t;
+
+/*
+ * Input image read row by row. Renderers which walk the input in row order
+ * ask for each row right before splatting it, so only one decoded row is
+ * kept and splatting starts during decoding. Interlaced files, and inputs
+ * which need random access (image_input_load()), are decoded at once.
+ */
+typedef struct image_input_s
+{
+	long unsigned int width;
+	long unsigned int height;
+	/* fully decoded image, NULL while streaming */
+	image_file_t *image;
+	image_format_t format;
+	FILE *fp;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	/* bytes per pam pixel, 3 or 4 */
+	unsigned int depth;
+	qoi_state_t qoi;
+	png_bytep row;
+	/* next row image_input_read() will return */
+	long unsigned int next;
+	/*
+	 * Non-transparent spans of every row, indexed as rows are decoded. Row y
+	 * has spans[ span_first[ y ] ] .. spans[ span_first[ y + 1 ] - 1 ].
+	 */
+	size_t *span_first;
+	pixel_span_t *spans;
+	size_t spans_count;
+	size_t spans_size;
+	long unsigned int indexed;
+} image_input_t;
+
+static void
+pam_read_header( image_input_t *in, const char *filename ) /* {{{ */
+{
+	char line[ 256 ];
+	unsigned int maxval = 0;
+
+	if ( !fgets( line, sizeof( line ), in->fp ) || strcmp( line, "P7\n" ) )
+		die( "File '%s' is not a pam", filename );
+	while ( fgets( line, sizeof( line ), in->fp ) )
+	{
+		if ( !strcmp( line, "ENDHDR\n" ) )
+		{
+			if ( !in->width || !in->height || maxval != 255
+					|| ( in->depth != 3 && in->depth != 4 ) )
+				die( "File '%s' is not an 8-bit RGB or RGB_ALPHA pam", filename );
+			return;
+		}
+		if ( sscanf( line, "WIDTH %lu", &in->width ) == 1
+				|| sscanf( line, "HEIGHT %lu", &in->height ) == 1
+				|| sscanf( line, "DEPTH %u", &in->depth ) == 1
+				|| sscanf( line, "MAXVAL %u", &maxval ) == 1 )
+			continue;
+		/* TUPLTYPE and comments */
+	}
+	die( "File '%s' has a truncated pam header", filename );
+} /* }}} */
+
+static void
+qoi_read_header( image_input_t *in, const char *filename ) /* {{{ */
+{
+	png_byte h[ QOI_HEADER_SIZE ];
+
+	if ( fread( h, 1, sizeof( h ), in->fp ) != sizeof( h ) || memcmp( h, "qoif", 4 ) )
+		die( "File '%s' is not a qoi", filename );
+	in->width = (uint32_t) h[4] << 24 | h[5] << 16 | h[6] << 8 | h[7];
+	in->height = (uint32_t) h[8] << 24 | h[9] << 16 | h[10] << 8 | h[11];
+	qoi_init( &in->qoi );
+} /* }}} */
+
+/* appends the spans of the next decoded row */
+static void
+image_input_index_row( image_input_t *in, const pixel_rgba_t *row ) /* {{{ */
+{
+	long unsigned int x = 0;
+
+	if ( !in->span_first )
+	{
+		in->span_first = calloc( sizeof( size_t ), in->height + 1 );
+		if ( !in->span_first )
+			die( "Cannot allocate span memory" );
+	}
+
+	while ( x < in->width )
+	{
+		pixel_span_t *span;
+		while ( x < in->width && !row[ x ].a )
+			x++;
+		if ( x == in->width )
+			break;
+
+		if ( in->spans_count == in->spans_size )
+		{
+			in->spans_size = in->spans_size ? in->spans_size * 2 : 1 << 10;
+			in->spans = realloc( in->spans, sizeof( pixel_span_t ) * in->spans_size );
+			if ( !in->spans )
+				die( "Cannot allocate span memory" );
+		}
+		span = in->spans + in->spans_count++;
+		span->start = x;
+		while ( x < in->width && row[ x ].a )
+			x++;
+		span->stop = x;
+	}
+	in->span_first[ ++in->indexed ] = in->spans_count;
+} /* }}} */
+
+/* indexes all rows of a fully decoded image */
+static void
+image_input_index_image( image_input_t *in ) /* {{{ */
+{
+	while ( in->indexed < in->height )
+		image_input_index_row( in,
+				(const pixel_rgba_t *) in->image->row_pointers[ in->indexed ] );
+} /* }}} */
+
+static void
+image_input_close( image_input_t **in ) /* {{{ */
+{
+	if ( (*in)->fp )
+	{
+		fclose( (*in)->fp );
+		if ( (*in)->format == FORMAT_PNG )
+			png_destroy_read_struct( &(*in)->png_ptr, &(*in)->info_ptr, NULL );
+	}
+	if ( (*in)->image )
+		image_destroy( &(*in)->image );
+	free( (*in)->span_first );
+	free( (*in)->spans );
+	free( (*in)->row );
+	free( *in );
+	*in = NULL;
+} /* }}} */
+
+/* die_hold() release of an image_input_t pointer, which may be NULL */
+static void
+image_input_release( void *slot )
+{
+	image_input_t **in = slot;
+	if ( *in )
+		image_input_close( in );
+}
+
+static image_input_t *
+image_input_open( const char *filename ) /* {{{ */
+{
+	image_input_t *in;
+	unsigned int mark;
+
+	in = calloc( 1, sizeof( image_input_t ) );
+	if ( !in )
+		die( "Cannot allocate input memory" );
+	mark = die_hold( &in, image_input_release );
+
+	in->format = image_format_from_magic( filename );
+	if ( in->format == FORMAT_JPEG )
+	{
+		in->image = image_from_jpeg( filename );
+		in->width = in->image->width;
+		in->height = in->image->height;
+		image_input_index_image( in );
+		die_unhold( mark );
+		return in;
+	}
+	if ( in->format != FORMAT_PNG )
+	{
+		in->fp = fopen( filename, "rb" );
+		if ( !in->fp )
+			die( "Cannot open file '%s'", filename );
+		if ( in->format == FORMAT_PAM )
+			pam_read_header( in, filename );
+		else
+			qoi_read_header( in, filename );
+
+		in->row = malloc( in->width * BYTES_PER_PIXEL );
+		if ( !in->row )
+			die( "Cannot allocate row memory" );
+		die_unhold( mark );
+		return in;
+	}
+
+	in->fp = png_open_read( filename, &in->png_ptr, &in->info_ptr );
+	in->width = png_get_image_width( in->png_ptr, in->info_ptr );
+	in->height = png_get_image_height( in->png_ptr, in->info_ptr );
+
+	if ( png_get_interlace_type( in->png_ptr, in->info_ptr ) != PNG_INTERLACE_NONE )
+	{
+		fclose( in->fp );
+		png_destroy_read_struct( &in->png_ptr, &in->info_ptr, NULL );
+		in->fp = NULL;
+		in->image = image_from_png( filename );
+		image_input_index_image( in );
+		die_unhold( mark );
+		return in;
+	}
+
+	in->row = malloc( in->width * BYTES_PER_PIXEL );
+	if ( !in->row )
+		die( "Cannot allocate row memory" );
+	die_unhold( mark );
+
+	return in;
+} /* }}} */
+
+static bool
+image_input_streaming( const image_input_t *in )
+{
+	return !in->image;
+}
+
+/* decodes the next row into row */
+static void
+image_input_read( image_input_t *in, png_bytep row ) /* {{{ */
+{
+	long unsigned int x;
+
+	switch ( in->format )
+	{
+		case FORMAT_PAM:
+			if ( fread( row, in->depth, in->width, in->fp ) != in->width )
+				die( "Unexpected end of pam data" );
+			/* expand rgb in place, back to front */
+			if ( in->depth == 3 )
+			{
+				for ( x = in->width; x-- > 0; )
+				{
+					row[ 4 * x + 3 ] = 255;
+					row[ 4 * x + 2 ] = row[ 3 * x + 2 ];
+					row[ 4 * x + 1 ] = row[ 3 * x + 1 ];
+					row[ 4 * x ] = row[ 3 * x ];
+				}
+			}
+			break;
+		case FORMAT_QOI:
+			qoi_decode_row( &in->qoi, in->fp, (pixel_rgba_t *) row, in->width );
+			break;
+		default:
+			if ( setjmp( png_jmpbuf( in->png_ptr ) ) )
+			{
+				die( "Error during image read" );
+			}
+			png_read_row( in->png_ptr, row, NULL );
+			break;
+	}
+	image_input_index_row( in, (const pixel_rgba_t *) row );
+	in->next++;
+} /* }}} */
+
+/* decodes the remaining rows, must be called before any row is taken */
+static void
+image_input_load( image_input_t *in ) /* {{{ */
+{
+	long unsigned int y;
+
+	if ( in->image )
+		return;
+	if ( in->next )
+		die( "Cannot load partially streamed image" );
+
+	in->image = malloc( sizeof( image_file_t ) );
+	in->image->width = in->width;
+	in->image->height = in->height;
+	in->image->row_pointers = image_rows_new( in->width, in->height, false );
+
+	if ( in->format != FORMAT_PNG )
+	{
+		for ( y = 0; y < in->height; y++ )
+			image_input_read( in, in->image->row_pointers[ y ] );
+		return;
+	}
+
+	if ( setjmp( png_jmpbuf( in->png_ptr ) ) )
+	{
+		die( "Error during image read" );
+	}
+
+	png_read_image( in->png_ptr, in->image->row_pointers );
+	in->next = in->height;
+	image_input_index_image( in );
+} /* }}} */
+
+/* while streaming, rows must be asked for in increasing order */
+static const pixel_rgba_t *
+image_input_row( image_input_t *in, long unsigned int y ) /* {{{ */
+{
+	if ( in->image )
+		return (const pixel_rgba_t *) in->image->row_pointers[ y ];
+
+	if ( y + 1 < in->next )
+		die( "Row %lu of a streamed image was already decoded", y );
+
+	while ( in->next <= y )
+		image_input_read( in, in->row );
+
+	return (const pixel_rgba_t *) in->row;
+} /* }}} */
+
+/* spans of row y, which is decoded if needed, see image_input_row() */
+static const pixel_span_t *
+image_input_spans( image_input_t *in, long unsigned int y, size_t *count ) /* {{{ */
+{
+	image_input_row( in, y );
+	*count = in->span_first[ y + 1 ] - in->span_first[ y ];
+	return in->spans + in->span_first[ y ];
+} /* }}} */
+
+/* png, jpeg, pam or qoi, picked by content */
+image_file_t *image_from_file( const char *filename ) /* {{{ */
+{
+	image_input_t *in;
+	image_file_t *image;
+
+	switch ( image_format_from_magic( filename ) )
+	{
+		case FORMAT_PNG:
+			return image_from_png( filename );
+		case FORMAT_JPEG:
+			return image_from_jpeg( filename );
+		default:
+			break;
+	}
+
+	in = image_input_open( filename );
+	image_input_load( in );
+	image = in->image;
+	in->image = NULL;
+	image_input_close( &in );
+
+	return image;
+} /* }}} */
+
+static double
+coord_dist( const coord_t * restrict a, const coord_t * restrict b )
+{
+	double x = b->x - a->x;
+	double y = b->y - a->y;
+	return sqrt( x * x + y * y );
+}
+
+static inline coord_t
+coord_subst( const coord_t * restrict a, const coord_t * restrict b )
+{
+	coord_t output;
+	output.x = a->x - b->x;
+	output.y = a->y - b->y;
+	return output;
+}
+
+static inline coord_t
+coord_add( const coord_t * restrict a, const coord_t * restrict b )
+{
+	coord_t output;
+	output.x = a->x + b->x;
+	output.y = a->y + b->y;
+	return output;
+}
+
+static inline coord_t
+coord_scale( const coord_t * restrict a, double mult )
+{
+	coord_t output;
+	output.x = a->x * mult;
+	output.y = a->y * mult;
+	return output;
+}
+
+static inline coord_t
+coord_middle( const coord_t * restrict a, const coord_t * restrict b )
+{
+	coord_t tmp = coord_add( a, b );
+	return coord_scale( &tmp, 0.5 );
+}
+
+/* calculate intersection of two lines, each one defined by 2 points */
+/* zero for parallel vectors */
+static inline double
+calc_cross( const coord_t * restrict v1, const coord_t * restrict v2 )
+{
+	return v1->x * v2->y - v1->y * v2->x;
+}
+
+static coord_t
+calc_intersection(
+		const coord_t * restrict a,
+		const coord_t * restrict b,
+		const coord_t * restrict c,
+		const coord_t * restrict d ) /* {{{ */
+{
+	coord_t v1, v2;
+	double down, k;
+
+	v1 = coord_subst( a, b );
+	v2 = coord_subst( c, d );
+
+	down = calc_cross( &v1, &v2 );
+	if ( ! down )
+		die( "Lines are parallel" );
+
+	k = v2.y * ( c->x - a->x ) + v2.x * ( a->y - c->y );
+
+	v2 = coord_scale( &v1, k / down );
+	return coord_add( a, &v2 );
+} /* }}} */
+
+static size_t
+weight_arena_alloc( weight_arena_t *arena, size_t count ) /* {{{ */
+{
+	size_t offset = arena->used;
+
+	if ( arena->used + count > arena->size )
+	{
+		arena->size = arena->size ? arena->size * 2 : 1 << 20;
+		if ( arena->size < arena->used + count )
+			arena->size = arena->used + count;
+		arena->data = realloc( arena->data, sizeof( double ) * arena->size );
+		if ( !arena->data )
+			die( "Cannot allocate weight memory" );
+	}
+	arena->used += count;
+
+	return offset;
+} /* }}} */
+
+/* grows data to exactly count more than used, so no doubling slack is left */
+static void
+weight_arena_reserve( weight_arena_t *arena, size_t count ) /* {{{ */
+{
+	if ( arena->used + count <= arena->size )
+		return;
+	arena->size = arena->used + count;
+	arena->data = realloc( arena->data, sizeof( double ) * arena->size );
+	if ( !arena->data )
+		die( "Cannot allocate weight memory" );
+} /* }}} */
+
+/* returns kernel slot i of the index, growing it as needed */
+static uint32_t *
+kernel_bank_index( kernel_bank_t *bank, size_t i ) /* {{{ */
+{
+	size_t per_radius = bank->phase_steps * bank->phase_steps;
+
+	if ( i >= bank->index_size )
+	{
+		size_t size = ( i / per_radius + 1 ) * per_radius * 2;
+		bank->index = realloc( bank->index, sizeof( uint32_t ) * size );
+		if ( !bank->index )
+			die( "Cannot allocate kernel index memory" );
+		memset( bank->index + bank->index_size, 0,
+				sizeof( uint32_t ) * ( size - bank->index_size ) );
+		bank->index_size = size;
+	}
+
+	return bank->index + i;
+} /* }}} */
+
+/* returns kernel slot for the quantized triple */
+static uint32_t *
+kernel_bank_slot( kernel_bank_t *bank, unsigned long int ri,
+		unsigned long int pxi, unsigned long int pyi ) /* {{{ */
+{
+	size_t per_radius = bank->phase_steps * bank->phase_steps;
+
+	return kernel_bank_index( bank, ri * per_radius + pyi * bank->phase_steps + pxi );
+} /* }}} */
+
+/* appends an uninitialized kernel, and shape while sizing, returns its index */
+static uint32_t
+kernel_bank_add( kernel_bank_t *bank ) /* {{{ */
+{
+	if ( bank->count == bank->size )
+	{
+		bank->size = bank->size ? bank->size * 2 : 1 << 12;
+		bank->kernels = realloc( bank->kernels, sizeof( bokeh_kernel_t ) * bank->size );
+		if ( !bank->kernels )
+			die( "Cannot allocate kernel memory" );
+		/* shapes are needed only until the weights are filled in */
+		if ( !bank->weights.data )
+		{
+			bank->shapes = realloc( bank->shapes, sizeof( kernel_shape_t ) * bank->size );
+			if ( !bank->shapes )
+				die( "Cannot allocate kernel memory" );
+		}
+	}
+
+	return bank->count++;
+} /* }}} */
+
+/*
+ * Moves the sized kernels of part into bank and renumbers the count circles
+ * using them. Quantized kernels bank already has are not taken again. No
+ * weights exist yet, so this moves only sizes and shapes, and the offsets
+ * of all kernels end up in one numbering for a single weights allocation.
+ */
+static void
+kernel_bank_merge( kernel_bank_t *bank, kernel_bank_t *part,
+		bokeh_circle_t *circles, size_t count ) /* {{{ */
+{
+	uint32_t *map;
+	size_t i;
+
+	map = malloc( sizeof( uint32_t ) * ( part->count + 1 ) );
+	if ( !map )
+		die( "Cannot allocate kernel memory" );
+
+	for ( i = 0; i < part->count; i++ )
+		map[ i ] = UINT32_MAX;
+	for ( i = 0; i < part->index_size && i < bank->index_size; i++ )
+		if ( part->index[ i ] && bank->index[ i ] )
+			map[ part->index[ i ] - 1 ] = bank->index[ i ] - 1;
+
+	for ( i = 0; i < part->count; i++ )
+	{
+		const bokeh_kernel_t *from = part->kernels + i;
+		bokeh_kernel_t *kernel;
+		uint32_t k;
+
+		if ( map[ i ] != UINT32_MAX )
+			continue;
+		k = kernel_bank_add( bank );
+		kernel = bank->kernels + k;
+		*kernel = *from;
+		kernel->offset = bank->weights.used;
+		bank->weights.used += from->width * from->height;
+		bank->shapes[ k ] = part->shapes[ i ];
+		map[ i ] = k;
+	}
+	for ( i = 0; i < part->index_size; i++ )
+	{
+		uint32_t *slot;
+		if ( !part->index[ i ] )
+			continue;
+		slot = kernel_bank_index( bank, i );
+		if ( !*slot )
+			*slot = map[ part->index[ i ] - 1 ] + 1;
+	}
+
+	for ( i = 0; i < count; i++ )
+		circles[ i ].kernel = map[ circles[ i ].kernel ];
+
+	free( map );
+	free( part->kernels );
+	free( part->shapes );
+	free( part->index );
+	memset( part, 0, sizeof( *part ) );
+} /* }}} */
+
+/*
+ * Places the circle and sizes its kernel, the weights are filled in by
+ * calc_bokeh_kernel() once all kernels of the table are sized.
+ */
+static void
+calc_bokeh_circle( const coord_t *out, double r,
+		bokeh_circle_t * restrict circle, kernel_bank_t * restrict bank ) /* {{{ */
+{
+	bokeh_kernel_t *kernel;
+	kernel_shape_t *shape;
+	uint32_t *slot = NULL;
+	coord_t quantized;
+	unsigned long int width, height;
+	double cx, cy;
+
+	if ( bank->radius_steps )
+	{
+		double fx = floor( out->x ), fy = floor( out->y );
+		unsigned long int pxi, pyi;
+
+		r = round( r * bank->radius_steps ) / bank->radius_steps;
+		pxi = round( ( out->x - fx ) * bank->phase_steps );
+		pyi = round( ( out->y - fy ) * bank->phase_steps );
+		quantized.x = fx + (double) pxi / bank->phase_steps;
+		quantized.y = fy + (double) pyi / bank->phase_steps;
+		out = &quantized;
+
+		if ( r < 0.75 )
+			r = 0.75;
+		slot = kernel_bank_slot( bank, round( r * bank->radius_steps ),
+				pxi % bank->phase_steps, pyi % bank->phase_steps );
+	}
+
+	if ( r < 0.75 )
+		r = 0.75;
+	double r_int = ceil( r - 0.5 );
+
+	cx = r_int - 1 + out->x - floor( out->x );
+	cy = r_int - 1 + out->y - floor( out->y );
+
+	if ( cx < r - 0.5 )
+		cx += 1;
+	if ( cy < r - 0.5 )
+		cy += 1;
+	width = ceil( cx + r + 0.5 );
+	height = ceil( cy + r + 0.5 );
+
+	/* sould be integers, but it is safer to round */
+	circle->outx = round( out->x - cx );
+	circle->outy = round( out->y - cy );
+
+	if ( slot && *slot )
+	{
+		circle->kernel = *slot - 1;
+		return;
+	}
+
+	if ( width > UINT16_MAX || height > UINT16_MAX )
+		die( "Bokeh radius %f is too large", r );
+
+	circle->kernel = kernel_bank_add( bank );
+	if ( slot )
+		*slot = bank->count;
+
+	kernel = bank->kernels + circle->kernel;
+	kernel->offset = bank->weights.used;
+	kernel->width = width;
+	kernel->height = height;
+	bank->weights.used += width * height;
+
+	shape = bank->shapes + circle->kernel;
+	shape->r = r;
+	shape->cx = cx;
+	shape->cy = cy;
+} /* }}} */
+
+#define BOKEH_KERNEL_COLUMNS 256
+
+/*
+ * Integrates the disc of shape over every tap of kernel. The far and near
+ * squared x distances of a column are the same on every row, so kernels up
+ * to BOKEH_KERNEL_COLUMNS wide take them from a table.
+ */
+static void
+calc_bokeh_kernel( const kernel_shape_t *shape, const bokeh_kernel_t *kernel,
+		double * restrict pixel ) /* {{{ */
+{
+	unsigned long int x, y, width = kernel->width, height = kernel->height;
+	size_t i, taps = width * height;
+	double dy1, dy2, dx1, dx2, tmp, sum = 0;
+	double r = shape->r, r2 = r * r, cx = shape->cx, cy = shape->cy;
+	double far[ BOKEH_KERNEL_COLUMNS ], near[ BOKEH_KERNEL_COLUMNS ];
+
+	for ( x = 0; x < width && x < BOKEH_KERNEL_COLUMNS; x++ )
+	{
+		dx1 = x - 0.5 - cx; dx1 *= dx1;
+		dx2 = x + 0.5 - cx; dx2 *= dx2;
+		far[ x ] = dx1 > dx2 ? dx1 : dx2;
+		near[ x ] = dx1 > dx2 ? dx2 : dx1;
+	}
+
+	for ( y = 0; y < height; y++ )
+	{
+		dy1 = y - 0.5 - cy; dy1 *= dy1;
+		dy2 = y + 0.5 - cy; dy2 *= dy2;
+		if ( dy2 > dy1 )
+		{
+			tmp = dy1;
+			dy1 = dy2;
+			dy2 = tmp;
+		}
+
+		for ( x = 0; x < width; x++ )
+		{
+			double value = 0;
+			if ( x < BOKEH_KERNEL_COLUMNS )
+			{
+				dx1 = far[ x ];
+				dx2 = near[ x ];
+			}
+			else
+			{
+				dx1 = x - 0.5 - cx; dx1 *= dx1;
+				dx2 = x + 0.5 - cx; dx2 *= dx2;
+				if ( dx2 > dx1 )
+				{
+					tmp = dx1;
+					dx1 = dx2;
+					dx2 = tmp;
+				}
+			}
+
+			if ( dx1 + dy1 < r2 )
+			{
+				value = 1;
+			}
+			else if ( dx2 + dy2 < r2 )
+			{
+				double d_max, d_min, diff, filled;
+				d_max = sqrt( dx1 + dy1 );
+				d_min = sqrt( dx2 + dy2 );
+				diff = d_max - d_min;
+				filled = r - d_min;
+				value = filled / diff;
+			}
+
+			pixel[ y * width + x ] = value;
+			sum += value;
+		}
+	}
+
+	/* normalize, one flat loop the compiler can vectorize */
+	for ( i = 0; i < taps; i++ )
+		pixel[ i ] /= sum;
+} /* }}} */
+
+static coord_t *
+calc_hiperbolic_distribution(
+		const coord_t * restrict origin,
+		const coord_t * restrict a,
+		const coord_t * restrict b,
+		unsigned long int divisions ) /* {{{ */
+{
+	unsigned long int i;
+	double d1, d2, h, m;
+	coord_t v1, v2, *out;
+
+	d1 = coord_dist( origin, a );
+	d2 = coord_dist( origin, b );
+
+	h = (double) divisions * d2 / ( d2 - d1 );
+	m = - h * d1;
+
+	v1 = coord_subst( a, origin );
+	/*v1.x = a->x - origin->x;
+	v1.y = a->y - origin->y;*/
+
+	out = malloc( sizeof( coord_t ) * divisions );
+	if ( !out )
+		die( "Cannot allocate table rows memory" );
+
+	for ( i = 0; i < divisions; i++ )
+	{
+		double y = m / ( (double) i - h );
+		v2 = coord_scale( &v1, y / d1 );
+		/*v2.x = v1.x * y / d1;
+		v2.y = v1.y * y / d1;*/
+		out[ i ] = coord_add( origin, &v2 );
+		/*out[ i ].x = origin->x + v2.x;
+		out[ i ].y = origin->y + v2.y;*/
+	}
+
+	return out;
+} /* }}} */
+
+/* angle between the side and the middle point, seen from center */
+static double
+half_ellipse_alpha( const coord_t * restrict center,
+		const coord_t * restrict middle, const coord_t * restrict side ) /* {{{ */
+{
+	double angle_r1 = atan2( side->y - center->y, side->x - center->x );
+	double angle_middle = atan2( middle->y - center->y, middle->x - center->x );
+
+	return - angle_r1 + angle_middle;
+} /* }}} */
+
+/* the ellipse through side and middle exists only if this is positive */
+static double
+half_ellipse_under( const coord_t * restrict center,
+		const coord_t * restrict middle, const coord_t * restrict side ) /* {{{ */
+{
+	double r1 = coord_dist( center, side );
+	double m = coord_dist( center, middle ) * cos( half_ellipse_alpha( center, middle, side ) );
+
+	return r1 * r1 - m * m;
+} /* }}} */
+
+/* angle_cos and angle_sin of every point on the ellipse are the same for all rows */
+static void
+calc_half_ellipse(
+		const coord_t * const restrict center,
+		const coord_t * const restrict middle,
+		const coord_t * const restrict side,
+		const double * restrict angle_cos, const double * restrict angle_sin,
+		unsigned long int divisions, coord_t * restrict output ) /* {{{ */
+{
+	double r1, r2, dist_middle, angle_r1, beta_sin, beta_cos;
+	unsigned long int i;
+
+	r1 = coord_dist( center, side );
+	dist_middle = coord_dist( center, middle );
+	angle_r1 = atan2( side->y - center->y, side->x - center->x );
+
+	beta_sin = sin( angle_r1 );
+	beta_cos = cos( angle_r1 );
+
+	{
+		double alpha = half_ellipse_alpha( center, middle, side );
+		double under = half_ellipse_under( center, middle, side );
+		if ( under <= 0 )
+			die( "Wrong distance in half_ellipse" );
+		r2 = ( dist_middle * r1 * sin( alpha ) ) / sqrt( under );
+	}
+
+	/* no calls left in here, gcc -O2 computes x and y as one SSE2 pair */
+	for ( i = 0; i < divisions; i++ )
+	{
+		double a = r1 * angle_cos[ i ];
+		double b = r2 * angle_sin[ i ];
+		output[ i ].x = center->x + a * beta_cos - b * beta_sin;
+		output[ i ].y = center->y + a * beta_sin + b * beta_cos;
+	}
+} /* }}} */
+
+#define BOKEH_SHARP 2.5
+#define BOKEH_BLURRY 5
+/*
+ * at distance r1 bokeh is BOKEH_SHARP
+ * at distance r2 bokeh is BOKEH_BLURRY
+ */
+static inline double
+calc_bokeh_radius( const coord_t * restrict p,
+		const coord_t * restrict e_f1, const coord_t * restrict e_f2,
+		double r1, double r2 ) /* {{{ */
+{
+	double d = coord_dist( e_f1, p ) + coord_dist( e_f2, p );
+
+	if ( d < r1 )
+		return BOKEH_SHARP;
+	return BOKEH_SHARP + ( d - r1 ) * ( ( BOKEH_BLURRY - BOKEH_SHARP ) / ( r2 - r1 ) );
+} /* }}} */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846 /* XSI, not C99 */
+#endif
+
+/* area shared by discs of radii a and b with centers d apart */
+static double
+disc_lens_area( double d, double a, double b ) /* {{{ */
+{
+	double a2 = a * a, b2 = b * b, d2 = d * d;
+
+	if ( d >= a + b )
+		return 0;
+	if ( d <= fabs( a - b ) )
+		return M_PI * ( a < b ? a2 : b2 );
+	return a2 * acos( ( d2 + a2 - b2 ) / ( 2 * d * a ) )
+		+ b2 * acos( ( d2 + b2 - a2 ) / ( 2 * d * b ) )
+		- 0.5 * sqrt( ( a + b - d ) * ( d + a - b ) * ( d - a + b ) * ( d + a + b ) );
+} /* }}} */
+
+#define SAT_CUT_STEPS 1000
+
+/*
+ * With kernels cut to ratio c of the bokeh radius, the sat engine blurs by
+ * the disc of radius c and then by the disc of radius sqrt( 1 - c^2 )
+ * instead of by the unit disc. Returns half the L1 distance between the two
+ * normalized kernels, the largest part of a full contrast edge they can
+ * move. Both are radially symmetric, so it is one integral over the
+ * distance from the center.
+ */
+static double
+sat_cut_error( double c ) /* {{{ */
+{
+	double h = sqrt( 1 - c * c ), top = c + h, step = top / SAT_CUT_STEPS, sum = 0;
+	double norm = 1 / ( M_PI * c * c * M_PI * h * h );
+	unsigned int i;
+
+	if ( c <= 0 || h <= 0 )
+		return 0;
+	for ( i = 0; i < SAT_CUT_STEPS; i++ )
+	{
+		double d = ( i + 0.5 ) * step;
+		double disc = d < 1 ? 1 / M_PI : 0;
+		sum += fabs( disc - disc_lens_area( d, c, h ) * norm ) * 2 * M_PI * d * step;
+	}
+
+	return sum / 2;
+} /* }}} */
+
+/*
+ * Smallest ratio of the bokeh radius kernels can be cut to while the sat
+ * engine stays within tolerance levels of the direct path, 1 for none. The
+ * error grows from nothing at ratio 0 to its peak and falls back to nothing
+ * at 1, and cut kernels take every ratio between the returned one and 1, so
+ * it is either past the peak or 0 if even the peak is within tolerance.
+ * Splatted alpha is multiplied by alpha_fix, and so is its error.
+ */
+static double
+sat_cut_ratio( double tolerance, double alpha_fix ) /* {{{ */
+{
+	double lo = 0, hi = 1, bound = tolerance / ( 255 * alpha_fix );
+	int i;
+
+	if ( tolerance <= 0 )
+		return 1;
+	for ( i = 0; i < 40; i++ )
+	{
+		double m1 = lo + ( hi - lo ) / 3, m2 = hi - ( hi - lo ) / 3;
+		if ( sat_cut_error( m1 ) < sat_cut_error( m2 ) )
+			lo = m1;
+		else
+			hi = m2;
+	}
+	if ( sat_cut_error( lo ) <= bound )
+		return 0;
+
+	hi = 1;
+	for ( i = 0; i < 40; i++ )
+	{
+		double m = ( lo + hi ) / 2;
+		if ( sat_cut_error( m ) <= bound )
+			hi = m;
+		else
+			lo = m;
+	}
+
+	return hi;
+} /* }}} */
+
+/* kernel radius of bokeh radius r, sharp ones are never cut */
+static inline double
+sat_cut_radius( double r, double ratio ) /* {{{ */
+{
+	if ( ratio >= 1 || r <= BOKEH_SHARP )
+		return r;
+	return r * ratio > BOKEH_SHARP ? r * ratio : BOKEH_SHARP;
+} /* }}} */
+
+static void
+calc_transform_line_bokeh(
+		const coord_t * restrict points, unsigned long int count,
+		const coord_t * restrict e_f1,
+		const coord_t * restrict e_f2,
+		double r1, double r2, double scale, double sat_ratio,
+		bokeh_circle_t * restrict output, kernel_bank_t * restrict bank ) /* {{{ */
+{
+	unsigned long int i;
+
+	for ( i = 0; i < count; i++ )
+	{
+		const coord_t *p = points + i;
+		double ball_r = sat_cut_radius( calc_bokeh_radius( p, e_f1, e_f2, r1, r2 ), sat_ratio );
+
+		/*
+		 * Focus is measured on the grid, only the circle is scaled. Pixel
+		 * centers are at whole coordinates, so the scaling is around -0.5.
+		 */
+		coord_t out = { ( p->x + 0.5 ) * scale - 0.5, ( p->y + 0.5 ) * scale - 0.5 };
+		calc_bokeh_circle( &out, ball_r * scale, output + i, bank );
+	}
+} /* }}} */
+
+#ifdef __GNUC__
+static void
+calc_transform_line_sharp( const coord_t *points, unsigned long int count,
+		bokeh_circle_t *output, kernel_bank_t *bank )
+	__attribute__ ((unused));
+#endif
+static void
+calc_transform_line_sharp( const coord_t *points, unsigned long int count,
+		bokeh_circle_t *output, kernel_bank_t *bank ) /* {{{ */
+{
+	unsigned long int i;
+
+	for ( i = 0; i < count; i++ )
+	{
+		const coord_t *p = points + i;
+		calc_bokeh_circle( p, BOKEH_SHARP, output + i, bank );
+	}
+} /* }}} */
+
+/*
+ * Fills row_out_first and window_rows. Circles off the output have empty
+ * kernels, so they do not count.
+ */
+static void
+calc_row_reach( transform_table_t *tt ) /* {{{ */
+{
+	unsigned long int x, y, stop = 0;
+	long int first;
+
+	tt->row_out_first = malloc( sizeof( int32_t ) * tt->patch_height );
+	if ( !tt->row_out_first )
+		die( "Cannot allocate row reach memory" );
+
+	first = tt->box.height;
+	for ( y = tt->patch_height; y-- > 0; )
+	{
+		const bokeh_circle_t *bc_row = tt->circles + y * tt->patch_width;
+		for ( x = 0; x < tt->patch_width; x++ )
+		{
+			const bokeh_circle_t *bokeh = bc_row + x;
+			if ( !tt->kernels[ bokeh->kernel ].height )
+				continue;
+			if ( bokeh->outy < first )
+				first = bokeh->outy;
+		}
+		tt->row_out_first[ y ] = first;
+	}
+
+	tt->window_rows = 1;
+	for ( y = 0; y < tt->patch_height; y++ )
+	{
+		const bokeh_circle_t *bc_row = tt->circles + y * tt->patch_width;
+		for ( x = 0; x < tt->patch_width; x++ )
+		{
+			const bokeh_circle_t *bokeh = bc_row + x;
+			unsigned long int reach;
+			if ( !tt->kernels[ bokeh->kernel ].height )
+				continue;
+			reach = bokeh->outy + tt->kernels[ bokeh->kernel ].height;
+			if ( reach > stop )
+				stop = reach;
+		}
+		if ( stop > tt->row_out_first[ y ]
+				&& stop - tt->row_out_first[ y ] > tt->window_rows )
+			tt->window_rows = stop - tt->row_out_first[ y ];
+	}
+} /* }}} */
+
+/* part of the kernel of bokeh on the output, as x0, y0, x1, y1 */
+static void
+calc_clip_bounds( const transform_table_t *tt, const bokeh_circle_t *bokeh,
+		const bokeh_kernel_t *kernel, long int *bounds ) /* {{{ */
+{
+	long int width = tt->output_width, height = tt->output_height;
+
+	bounds[ 0 ] = bokeh->outx < 0 ? - (long int) bokeh->outx : 0;
+	bounds[ 1 ] = bokeh->outy < 0 ? - (long int) bokeh->outy : 0;
+	bounds[ 2 ] = kernel->width;
+	bounds[ 3 ] = kernel->height;
+	if ( bokeh->outx + bounds[ 2 ] > width )
+		bounds[ 2 ] = width - bokeh->outx;
+	if ( bokeh->outy + bounds[ 3 ] > height )
+		bounds[ 3 ] = height - bokeh->outy;
+} /* }}} */
+
+/*
+ * Resolves the output bounds once, so renderers never check them. A circle
+ * whose kernel runs over an output edge gets a kernel of its own with only
+ * the taps on the output, and outx, outy moved to its first tap. Circles
+ * entirely off the output get one shared empty kernel. The clipped taps
+ * are counted first and the weights grow once, by exactly that much.
+ */
+static void
+calc_clip_circles( transform_table_t *tt, kernel_bank_t *bank ) /* {{{ */
+{
+	unsigned long int i, count = tt->patch_width * tt->patch_height;
+	long int empty = -1, b[ 4 ];
+	size_t taps = 0;
+
+	for ( i = 0; i < count; i++ )
+	{
+		const bokeh_circle_t *bokeh = tt->circles + i;
+		const bokeh_kernel_t *kernel = bank->kernels + bokeh->kernel;
+		calc_clip_bounds( tt, bokeh, kernel, b );
+		if ( !b[ 0 ] && !b[ 1 ] && b[ 2 ] == kernel->width && b[ 3 ] == kernel->height )
+			continue;
+		if ( b[ 2 ] > b[ 0 ] && b[ 3 ] > b[ 1 ] )
+			taps += ( b[ 2 ] - b[ 0 ] ) * ( b[ 3 ] - b[ 1 ] );
+	}
+	weight_arena_reserve( &bank->weights, taps );
+
+	tt->circles_dropped = 0;
+	tt->circles_clipped = 0;
+	for ( i = 0; i < count; i++ )
+	{
+		bokeh_circle_t *bokeh = tt->circles + i;
+		bokeh_kernel_t kernel = bank->kernels[ bokeh->kernel ], clip;
+		long int x0, y0, x1, y1, y;
+
+		calc_clip_bounds( tt, bokeh, &kernel, b );
+		x0 = b[ 0 ];
+		y0 = b[ 1 ];
+		x1 = b[ 2 ];
+		y1 = b[ 3 ];
+		if ( !x0 && !y0 && x1 == kernel.width && y1 == kernel.height )
+			continue;
+
+		if ( x1 <= x0 || y1 <= y0 )
+		{
+			if ( empty < 0 )
+			{
+				empty = kernel_bank_add( bank );
+				memset( bank->kernels + empty, 0, sizeof( bokeh_kernel_t ) );
+			}
+			bokeh->outx = 0;
+			bokeh->outy = 0;
+			bokeh->kernel = empty;
+			tt->circles_dropped++;
+			continue;
+		}
+
+		clip.width = x1 - x0;
+		clip.height = y1 - y0;
+		clip.offset = weight_arena_alloc( &bank->weights, clip.width * clip.height );
+		for ( y = y0; y < y1; y++ )
+			memcpy( bank->weights.data + clip.offset + ( y - y0 ) * clip.width,
+					bank->weights.data + kernel.offset + y * kernel.width + x0,
+					sizeof( double ) * clip.width );
+
+		bokeh->outx += x0;
+		bokeh->outy += y0;
+		bokeh->kernel = kernel_bank_add( bank );
+		bank->kernels[ bokeh->kernel ] = clip;
+		tt->circles_clipped++;
+	}
+
+#ifndef BENDER_LIBRARY
+	/* previews are dragged off the canvas all the time */
+	if ( tt->circles_dropped )
+		printf( "Warning, %lu patch pixels land outside of the output and are dropped\n",
+				tt->circles_dropped );
+#endif
+} /* }}} */
+
+/* sets box to the union of all kernels and moves the circles into it */
+static void
+calc_table_box( transform_table_t *tt, const kernel_bank_t *bank ) /* {{{ */
+{
+	unsigned long int i, count = tt->patch_width * tt->patch_height;
+	unsigned long int x0 = tt->output_width, y0 = tt->output_height, x1 = 0, y1 = 0;
+
+	for ( i = 0; i < count; i++ )
+	{
+		const bokeh_circle_t *bokeh = tt->circles + i;
+		const bokeh_kernel_t *kernel = bank->kernels + bokeh->kernel;
+		if ( !kernel->height )
+			continue;
+		if ( bokeh->outx < x0 )
+			x0 = bokeh->outx;
+		if ( bokeh->outy < y0 )
+			y0 = bokeh->outy;
+		if ( bokeh->outx + kernel->width > x1 )
+			x1 = bokeh->outx + kernel->width;
+		if ( bokeh->outy + kernel->height > y1 )
+			y1 = bokeh->outy + kernel->height;
+	}
+	if ( x1 <= x0 || y1 <= y0 )
+		x0 = y0 = x1 = y1 = 0;
+
+	tt->box.x = x0;
+	tt->box.y = y0;
+	tt->box.width = x1 - x0;
+	tt->box.height = y1 - y0;
+
+	for ( i = 0; i < count; i++ )
+	{
+		bokeh_circle_t *bokeh = tt->circles + i;
+		if ( !bank->kernels[ bokeh->kernel ].height )
+			continue;
+		bokeh->outx -= x0;
+		bokeh->outy -= y0;
+	}
+} /* }}} */
+
+/* radius of the blur left at pixel x, y of the output, in output pixels */
+static inline double
+calc_blur_radius( const table_params_t *params, double ratio,
+		double x, double y ) /* {{{ */
+{
+	const coord_t *list = params->list;
+	double scale = params->scale, r, k;
+	coord_t p = { ( x + 0.5 ) / scale - 0.5, ( y + 0.5 ) / scale - 0.5 };
+
+	r = calc_bokeh_radius( &p, list + POINT_FOCUS_F1, list + POINT_FOCUS_F2,
+			list[ POINT_FOCUS_R ].x, list[ POINT_FOCUS_R ].y );
+	k = scale * sat_cut_radius( r, ratio );
+	r *= scale;
+	/* as in calc_bokeh_circle() */
+	if ( r < 0.75 )
+		r = 0.75;
+	if ( k < 0.75 )
+		k = 0.75;
+	if ( r <= k )
+		return 0;
+	return sqrt( r * r - k * k );
+} /* }}} */
+
+/*
+ * Kernels are cut to ratio of the bokeh radius, see sat_cut_ratio(), the
+ * rest of the blur is left to the renderer. A disc of radius r spreads
+ * r^2 / 4 per axis, so a kernel of radius k followed by a disc of radius
+ * sqrt( r^2 - k^2 ) spreads as much as the full one. The second disc is
+ * taken at the radius of the output pixel itself rather than of the patch
+ * pixels landing around it, the radius changes slowly enough. The table
+ * box grows by the widest blur, which is at one of its corners as the
+ * radius is convex and the blur grows with it.
+ */
+static void
+calc_blur_map( transform_table_t *tt, const table_params_t *params, double ratio ) /* {{{ */
+{
+	unsigned long int i, x, y, count = tt->patch_width * tt->patch_height;
+	long int x0, y0, x1, y1, margin = 0;
+
+	tt->blur = NULL;
+	if ( !params->sat_tolerance || !tt->box.width )
+		return;
+
+	for ( i = 0; i < 4; i++ )
+	{
+		double h = calc_blur_radius( params, ratio,
+				tt->box.x + ( i & 1 ? tt->box.width - 1 : 0 ),
+				tt->box.y + ( i & 2 ? tt->box.height - 1 : 0 ) );
+		if ( ceil( h ) > margin )
+			margin = ceil( h );
+	}
+
+	x0 = tt->box.x - margin;
+	y0 = tt->box.y - margin;
+	x1 = tt->box.x + tt->box.width + margin;
+	y1 = tt->box.y + tt->box.height + margin;
+	if ( x0 < 0 )
+		x0 = 0;
+	if ( y0 < 0 )
+		y0 = 0;
+	if ( x1 > tt->output_width )
+		x1 = tt->output_width;
+	if ( y1 > tt->output_height )
+		y1 = tt->output_height;
+
+	for ( i = 0; i < count; i++ )
+	{
+		bokeh_circle_t *bokeh = tt->circles + i;
+		if ( !tt->kernels[ bokeh->kernel ].height )
+			continue;
+		bokeh->outx += tt->box.x - x0;
+		bokeh->outy += tt->box.y - y0;
+	}
+	tt->box.x = x0;
+	tt->box.y = y0;
+	tt->box.width = x1 - x0;
+	tt->box.height = y1 - y0;
+
+	tt->blur = malloc( sizeof( float ) * tt->box.width * tt->box.height );
+	if ( !tt->blur )
+		die( "Cannot allocate blur map memory" );
+	for ( y = 0; y < tt->box.height; y++ )
+		for ( x = 0; x < tt->box.width; x++ )
+			tt->blur[ y * tt->box.width + x ] =
+				calc_blur_radius( params, ratio, x0 + x, y0 + y );
+} /* }}} */
+
+/*
+ * Tables are built in two stages. The geometry stage maps every patch pixel
+ * to its destination point on the output, from hyperbolic distributions
+ * along the mug (the rows, which do not depend on the angles) and a half
+ * ellipse per row. The bokeh stage turns the points into kernels. Tuning the
+ * focus reruns only the bokeh stage, tuning the angles reuses the rows, see
+ * geometry_cache_t.
+ */
+
+/* everything the point grid depends on, zero-padded for hashing */
+typedef struct grid_params_s
+{
+	coord_t patch_size;
+	/* POINT_LEFT_TOP .. POINT_MIDDLE_BOTTOM */
+	coord_t outline[ 6 ];
+	coord_t angles;
+} grid_params_t;
+
+/* hyperbolic distributions of center, top and side points per patch row */
+typedef struct table_rows_s
+{
+	/* with patch_size.x and angles zeroed, they do not matter here */
+	grid_params_t params;
+	unsigned long int height;
+	coord_t *center;
+	coord_t *top;
+	coord_t *side;
+} table_rows_t;
+
+typedef struct point_grid_s
+{
+	grid_params_t params;
+	unsigned long int width;
+	unsigned long int height;
+	/* height * width destination points in scan order */
+	coord_t *points;
+} point_grid_t;
+
+static void
+grid_params_set( grid_params_t *gp, const table_params_t *params ) /* {{{ */
+{
+	memset( gp, 0, sizeof( *gp ) );
+	gp->patch_size = params->list[ POINT_PATCH_SIZE ];
+	memcpy( gp->outline, params->list + POINT_LEFT_TOP, sizeof( gp->outline ) );
+	gp->angles = params->list[ POINT_ANGLES ];
+} /* }}} */
+
+static void
+rows_params_set( grid_params_t *rp, const grid_params_t *gp ) /* {{{ */
+{
+	*rp = *gp;
+	rp->patch_size.x = 0;
+	rp->angles.x = 0;
+	rp->angles.y = 0;
+} /* }}} */
+
+static void
+destroy_table_rows( table_rows_t **rows )
+{
+	free( (*rows)->center );
+	free( (*rows)->top );
+	free( (*rows)->side );
+	free( *rows );
+	*rows = NULL;
+}
+
+/* die_hold() release of a table_rows_t pointer, which may be NULL */
+static void
+table_rows_release( void *slot )
+{
+	table_rows_t **rows = slot;
+	if ( *rows )
+		destroy_table_rows( rows );
+}
+
+static table_rows_t *
+calc_table_rows( const grid_params_t *rp ) /* {{{ */
+{
+	coord_t outline[ 12 ];
+	table_rows_t *rows;
+	coord_t m1, m2, end;
+	unsigned int mark;
+
+	/* indexed like table_params_t list */
+	memcpy( outline + POINT_LEFT_TOP, rp->outline, sizeof( rp->outline ) );
+
+	/* zeroed, so a partly built one can be released */
+	rows = calloc( 1, sizeof( table_rows_t ) );
+	if ( !rows )
+		die( "Cannot allocate table rows memory" );
+	mark = die_hold( &rows, table_rows_release );
+	rows->params = *rp;
+	rows->height = rp->patch_size.y;
+
+	m1 = coord_middle( outline + POINT_LEFT_TOP, outline + POINT_RIGHT_TOP );
+	m2 = coord_middle( outline + POINT_LEFT_BOTTOM, outline + POINT_RIGHT_BOTTOM );
+
+	end = calc_intersection( outline + POINT_LEFT_TOP, outline + POINT_LEFT_BOTTOM,
+			outline + POINT_RIGHT_TOP, outline + POINT_RIGHT_BOTTOM );
+
+	rows->center = calc_hiperbolic_distribution( &end, &m1, &m2, rows->height );
+
+	rows->top = calc_hiperbolic_distribution( &end,
+			outline + POINT_MIDDLE_TOP, outline + POINT_MIDDLE_BOTTOM,
+			rows->height );
+	rows->side = calc_hiperbolic_distribution( &end,
+			outline + POINT_LEFT_TOP, outline + POINT_LEFT_BOTTOM,
+			rows->height );
+	die_unhold( mark );
+
+	return rows;
+} /* }}} */
+
+/*
+ * Numbers the geometry stage would die on: parallel mug edges, which never
+ * meet, or a row whose middle point lies outside of its ellipse. Returns
+ * the message, NULL if the numbers describe a mug.
+ */
+static const char *
+table_params_check( const table_params_t *params ) /* {{{ */
+{
+	const coord_t *list = params->list;
+	const char *bad = NULL;
+	grid_params_t gp, rp;
+	table_rows_t *rows;
+	coord_t v1, v2;
+	unsigned long int i;
+
+	v1 = coord_subst( list + POINT_LEFT_TOP, list + POINT_LEFT_BOTTOM );
+	v2 = coord_subst( list + POINT_RIGHT_TOP, list + POINT_RIGHT_BOTTOM );
+	if ( !calc_cross( &v1, &v2 ) )
+		return "Lines are parallel";
+
+	grid_params_set( &gp, params );
+	rows_params_set( &rp, &gp );
+	rows = calc_table_rows( &rp );
+	for ( i = 0; i < rows->height && !bad; i++ )
+		if ( !( half_ellipse_under( rows->center + i, rows->top + i, rows->side + i ) > 0 ) )
+			bad = "Wrong distance in half_ellipse";
+	destroy_table_rows( &rows );
+
+	return bad;
+} /* }}} */
+
+typedef struct point_grid_job_s
+{
+	point_grid_t *grid;
+	const table_rows_t *rows;
+	double *angle_cos;
+	double *angle_sin;
+} point_grid_job_t;
+
+static void
+point_grid_rows( void *arg, unsigned long int job ) /* {{{ */
+{
+	const point_grid_job_t *pj = arg;
+	point_grid_t *grid = pj->grid;
+	unsigned long int i, i_stop;
+
+	i_stop = ( job + 1 ) * ROWS_PER_JOB;
+	if ( i_stop > grid->height )
+		i_stop = grid->height;
+
+	for ( i = job * ROWS_PER_JOB; i < i_stop; i++ )
+	{
+		calc_half_ellipse(
+			pj->rows->center + i, pj->rows->top + i, pj->rows->side + i,
+			pj->angle_cos, pj->angle_sin,
+			grid->width,
+			grid->points + i * grid->width
+		);
+	}
+} /* }}} */
+
+static void
+destroy_point_grid( point_grid_t **grid )
+{
+	free( (*grid)->points );
+	free( *grid );
+	*grid = NULL;
+}
+
+/* die_hold() release of a point_grid_t pointer, which may be NULL */
+static void
+point_grid_release( void *slot )
+{
+	point_grid_t **grid = slot;
+	if ( *grid )
+		destroy_point_grid( grid );
+}
+
+static point_grid_t *
+calc_point_grid( const grid_params_t *gp, const table_rows_t *rows,
+		workers_t *workers ) /* {{{ */
+{
+	point_grid_t *grid;
+	point_grid_job_t pj;
+	double angle_increment;
+	unsigned long int i;
+	unsigned int mark;
+
+	grid = calloc( 1, sizeof( point_grid_t ) );
+	if ( !grid )
+		die( "Cannot allocate point grid memory" );
+	mark = die_hold( &grid, point_grid_release );
+	grid->params = *gp;
+	grid->width = gp->patch_size.x;
+	grid->height = gp->patch_size.y;
+	grid->points = malloc( sizeof( coord_t ) * grid->width * grid->height );
+	if ( !grid->points )
+		die( "Cannot allocate point grid memory" );
+
+	/* every row walks the same angles */
+	pj.grid = grid;
+	pj.rows = rows;
+	pj.angle_cos = malloc( sizeof( double ) * grid->width );
+	pj.angle_sin = malloc( sizeof( double ) * grid->width );
+	die_hold( pj.angle_cos, free );
+	die_hold( pj.angle_sin, free );
+	if ( !pj.angle_cos || !pj.angle_sin )
+		die( "Cannot allocate point grid memory" );
+	angle_increment = ( gp->angles.y - gp->angles.x ) / ( grid->width - 1 );
+	for ( i = 0; i < grid->width; i++ )
+	{
+		double alpha = gp->angles.x + i * angle_increment;
+		pj.angle_cos[ i ] = cos( alpha );
+		pj.angle_sin[ i ] = sin( alpha );
+	}
+
+	workers_run( workers, point_grid_rows, &pj,
+			( grid->height + ROWS_PER_JOB - 1 ) / ROWS_PER_JOB );
+	die_unhold( mark );
+	free( pj.angle_cos );
+	free( pj.angle_sin );
+
+	return grid;
+} /* }}} */
+
+/*
+ * The bokeh stage splits the patch rows into one band per worker. Every band
+ * builds its kernels into a private bank, the banks are merged afterwards.
+ */
+typedef struct bokeh_band_s
+{
+	unsigned long int y_start;
+	unsigned long int y_stop;
+	kernel_bank_t bank;
+} bokeh_band_t;
+
+typedef struct bokeh_job_s
+{
+	const table_params_t *params;
+	const point_grid_t *grid;
+	transform_table_t *tt;
+	bokeh_band_t *bands;
+	unsigned int bands_count;
+	/* see sat_cut_ratio() */
+	double sat_ratio;
+} bokeh_job_t;
+
+static void
+kernel_bank_release( void *object ) /* {{{ */
+{
+	kernel_bank_t *bank = object;
+
+	free( bank->kernels );
+	free( bank->shapes );
+	free( bank->weights.data );
+	free( bank->index );
+} /* }}} */
+
+/* frees the bands and their banks, before they are merged */
+static void
+bokeh_job_release( void *object ) /* {{{ */
+{
+	bokeh_job_t *bj = object;
+	unsigned int b;
+
+	for ( b = 0; b < bj->bands_count; b++ )
+		kernel_bank_release( &bj->bands[ b ].bank );
+	free( bj->bands );
+} /* }}} */
+
+/*
+ * Dies if the bokeh stage would build a kernel too large for its 16-bit
+ * size, on the calling thread: the stage runs in workers, which cannot fail
+ * a daemon job or a library call. The radius grows with the sum of the
+ * distances to the foci, which is convex, so it is largest at a corner of
+ * the box around the grid.
+ */
+static void
+calc_bokeh_radius_check( const table_params_t *params, const point_grid_t *grid,
+		double sat_ratio ) /* {{{ */
+{
+	const coord_t *list = params->list;
+	coord_t lo = { INFINITY, INFINITY }, hi = { -INFINITY, -INFINITY }, corner[ 4 ];
+	size_t i, count = grid->width * grid->height;
+
+	for ( i = 0; i < count; i++ )
+	{
+		const coord_t *p = grid->points + i;
+		lo.x = p->x < lo.x ? p->x : lo.x;
+		lo.y = p->y < lo.y ? p->y : lo.y;
+		hi.x = p->x > hi.x ? p->x : hi.x;
+		hi.y = p->y > hi.y ? p->y : hi.y;
+	}
+	corner[ 0 ] = lo;
+	corner[ 1 ] = hi;
+	corner[ 2 ].x = lo.x;
+	corner[ 2 ].y = hi.y;
+	corner[ 3 ].x = hi.x;
+	corner[ 3 ].y = lo.y;
+
+	for ( i = 0; i < 4 && count; i++ )
+	{
+		double r = calc_bokeh_radius( corner + i, list + POINT_FOCUS_F1, list + POINT_FOCUS_F2,
+				list[ POINT_FOCUS_R ].x, list[ POINT_FOCUS_R ].y );
+		r = params->scale * sat_cut_radius( r, sat_ratio );
+		/* calc_bokeh_circle() kernels are a few pixels wider than 2 r */
+		if ( !( 2 * r + 4 <= UINT16_MAX ) )
+			die( "Bokeh radius %f is too large", r );
+	}
+} /* }}} */
+
+static void
+bokeh_band_rows( void *arg, unsigned long int job ) /* {{{ */
+{
+	const bokeh_job_t *bj = arg;
+	const coord_t *list = bj->params->list;
+	bokeh_band_t *band = bj->bands + job;
+	unsigned long int width = bj->grid->width;
+	unsigned long int i;
+
+	for ( i = band->y_start; i < band->y_stop; i++ )
+	{
+		/* calc_transform_line_sharp( bj->grid->points + i * width, width,
+				bj->tt->circles + i * width, &band->bank ); */
+		calc_transform_line_bokeh(
+				bj->grid->points + i * width, width,
+				list + POINT_FOCUS_F1, list + POINT_FOCUS_F2,
+				list[ POINT_FOCUS_R ].x, list[ POINT_FOCUS_R ].y,
+				bj->params->scale, bj->sat_ratio,
+				bj->tt->circles + i * width, &band->bank
+				);
+	}
+} /* }}} */
+
+#define KERNEL_FILL_CHUNK 256
+
+/* fills in the weights of the job-th KERNEL_FILL_CHUNK kernels */
+static void
+kernel_bank_fill( void *arg, unsigned long int job ) /* {{{ */
+{
+	const kernel_bank_t *bank = arg;
+	size_t k, first = job * KERNEL_FILL_CHUNK, stop = first + KERNEL_FILL_CHUNK;
+
+	if ( stop > bank->count )
+		stop = bank->count;
+	for ( k = first; k < stop; k++ )
+		calc_bokeh_kernel( bank->shapes + k, bank->kernels + k,
+				bank->weights.data + bank->kernels[ k ].offset );
+} /* }}} */
+
+static void
+destroy_transform_table( transform_table_t **tt )
+{
+	if ( (*tt)->map )
+	{
+		munmap( (*tt)->map, (*tt)->map_size );
+	}
+	else
+	{
+		free( (*tt)->circles );
+		free( (*tt)->kernels );
+		free( (*tt)->weights );
+		free( (*tt)->row_out_first );
+		free( (*tt)->blur );
+	}
+	free( *tt );
+	*tt = NULL;
+}
+
+/* die_hold() release of a table, whole or partially built */
+static void
+transform_table_release( void *object )
+{
+	transform_table_t *tt = object;
+	destroy_transform_table( &tt );
+}
+
+/*
+ * Bokeh stage, grid must match params or be decimated, built for a patch N
+ * times smaller. Destinations, radii and the output are multiplied by
+ * params->scale; kernels integrate the disc over whole output pixels, so a
+ * scaled table applies the box filter a downscale of the full size render
+ * would to everything but alpha, which normalizing clamps per output pixel.
+ */
+static transform_table_t *
+calc_transform_table( const table_params_t *params, const point_grid_t *grid,
+		workers_t *workers ) /* {{{ */
+{
+	const coord_t *list = params->list;
+	double scale = params->scale;
+	transform_table_t *output;
+	kernel_bank_t bank;
+	bokeh_job_t bj;
+	unsigned long int input_width, input_height, output_width, output_height;
+	unsigned long int full_width = list[ POINT_PATCH_SIZE ].x;
+	unsigned long int bands_count = workers ? workers->count : 1;
+	double density;
+	unsigned int b, mark, bands_mark;
+
+	input_width = grid->width;
+	input_height = grid->height;
+	output_width = floor( list[ POINT_BG_SIZE ].x * scale + 0.5 );
+	output_height = floor( list[ POINT_BG_SIZE ].y * scale + 0.5 );
+
+	output = calloc( 1, sizeof( transform_table_t ) );
+	if ( !output )
+		die( "Cannot allocate transform table memory" );
+	mark = die_hold( output, transform_table_release );
+	output->circles = malloc( sizeof( bokeh_circle_t ) * input_width * input_height );
+	if ( !output->circles )
+		die( "Cannot allocate transform table memory" );
+
+	output->patch_width = input_width;
+	output->patch_height = input_height;
+	output->output_width = output_width;
+	output->output_height = output_height;
+	output->map = NULL;
+	output->map_size = 0;
+
+	{
+		double x1, x2;
+		x1 = list[ POINT_RIGHT_TOP ].x - list[ POINT_LEFT_TOP ].x;
+		x2 = list[ POINT_RIGHT_BOTTOM ].x - list[ POINT_LEFT_BOTTOM ].x;
+		if ( x2 > x1 )
+			x1 = x2;
+		if ( x1 * 1.5 > full_width )
+		{
+			output->alpha_fix = x1 * 1.5 / full_width;
+		}
+		else
+		{
+			output->alpha_fix = 1;
+		}
+	}
+	/*
+	 * Splatted alpha grows with patch pixels per output pixel, keep it as in
+	 * a full size render of the full patch.
+	 */
+	density = full_width * scale / input_width;
+	output->alpha_fix *= density * density;
+
+	if ( bands_count > input_height )
+		bands_count = input_height ? input_height : 1;
+	bj.params = params;
+	bj.grid = grid;
+	bj.tt = output;
+	bj.bands = calloc( sizeof( bokeh_band_t ), bands_count );
+	if ( !bj.bands )
+		die( "Cannot allocate band memory" );
+	bj.bands_count = bands_count;
+	bj.sat_ratio = sat_cut_ratio( params->sat_tolerance, output->alpha_fix );
+	bands_mark = die_hold( &bj, bokeh_job_release );
+	for ( b = 0; b < bands_count; b++ )
+	{
+		bokeh_band_t *band = bj.bands + b;
+		band->y_start = input_height * b / bands_count;
+		band->y_stop = input_height * ( b + 1 ) / bands_count;
+		if ( params->radius_steps && params->phase_steps )
+		{
+			band->bank.radius_steps = params->radius_steps;
+			band->bank.phase_steps = params->phase_steps;
+		}
+	}
+	calc_bokeh_radius_check( params, grid, bj.sat_ratio );
+	workers_run( workers, bokeh_band_rows, &bj, bands_count );
+
+	/* one band is all there is, as before */
+	bank = bj.bands[ 0 ].bank;
+	for ( b = 1; b < bands_count; b++ )
+	{
+		bokeh_band_t *band = bj.bands + b;
+		kernel_bank_merge( &bank, &band->bank, output->circles + band->y_start * input_width,
+				( band->y_stop - band->y_start ) * input_width );
+	}
+	die_unhold( bands_mark );
+	die_hold( &bank, kernel_bank_release );
+	free( bj.bands );
+
+	/* every kernel is sized now, so the weights are allocated once */
+	weight_arena_reserve( &bank.weights, 0 );
+	workers_run( workers, kernel_bank_fill, &bank,
+			( bank.count + KERNEL_FILL_CHUNK - 1 ) / KERNEL_FILL_CHUNK );
+	free( bank.shapes );
+	bank.shapes = NULL;
+
+	calc_clip_circles( output, &bank );
+	calc_table_box( output, &bank );
+	/* give back the slack of the last kernels doubling, if the allocator can */
+	output->kernels = bank.count ?
+			realloc( bank.kernels, sizeof( bokeh_kernel_t ) * bank.count ) : NULL;
+	if ( !output->kernels )
+		output->kernels = bank.kernels;
+	output->kernels_count = bank.count;
+	output->weights = bank.weights.data;
+	output->weights_count = bank.weights.used;
+	free( bank.shapes );
+	free( bank.index );
+	die_unhold( bands_mark );
+
+	calc_blur_map( output, params, bj.sat_ratio );
+	calc_row_reach( output );
+	die_unhold( mark );
+
+	return output;
+} /* }}} */
+
+
+/* memory held by a table, mapped tables count as well */
+static size_t
+transform_table_bytes( const transform_table_t *tt ) /* {{{ */
+{
+	if ( tt->map )
+		return tt->map_size;
+	return sizeof( bokeh_circle_t ) * tt->patch_width * tt->patch_height
+		+ sizeof( bokeh_kernel_t ) * tt->kernels_count
+		+ sizeof( double ) * tt->weights_count
+		+ sizeof( int32_t ) * tt->patch_height
+		+ ( tt->blur ? sizeof( float ) * tt->box.width * tt->box.height : 0 );
+} /* }}} */
+
+/*
+ * Transform table files.
+ *
+ * Building the table is by far the most expensive part of a short bender run
+ * and it depends only on the 24 numeric arguments, so the table can be saved
+ * once and mapped read-only by every later run with the same arguments.
+ * All processes mapping the same file share its pages.
+ *
+ * File layout, native endianness and word size (it is a cache, not an
+ * exchange format):
+ *
+ *   transform_file_header_t
+ *   bokeh_circle_t circles[ patch_height * patch_width ]  - scan order
+ *   bokeh_kernel_t kernels[ kernels_count ]              - 8-byte aligned
+ *   double weights[ weights_count ]
+ *   int32_t row_out_first[ patch_height ]
+ *   float blur[ blur_count ]                              - box sized or none
+ *
+ * This is exactly the in-memory layout, so a mapped table needs no fixups.
+ */
+#define TRANSFORM_FILE_MAGIC "BENDTT09"
+
+typedef struct transform_file_header_s
+{
+	char magic[8];
+	uint64_t key;
+	table_params_t params;
+	uint64_t output_width;
+	uint64_t output_height;
+	uint64_t patch_width;
+	uint64_t patch_height;
+	double alpha_fix;
+	image_box_t box;
+	uint64_t kernels_count;
+	uint64_t weights_count;
+	uint64_t window_rows;
+	uint64_t blur_count;
+	uint64_t circles_dropped;
+	uint64_t circles_clipped;
+	uint64_t size;
+} transform_file_header_t;
+
+static size_t
+transform_file_circles_size( uint64_t count )
+{
+	/* keep weights aligned */
+	size_t size = sizeof( bokeh_circle_t ) * count;
+	return ( size + sizeof( double ) - 1 ) & ~( sizeof( double ) - 1 );
+}
+
+/* FNV-1a over raw memory, structures must be zero-padded */
+static uint64_t
+fnv1a( const void *data, size_t size ) /* {{{ */
+{
+	const unsigned char *p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for ( i = 0; i < size; i++ )
+	{
+		hash ^= p[ i ];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+} /* }}} */
+
+static uint64_t
+transform_table_key( const table_params_t *params )
+{
+	return fnv1a( params, sizeof( table_params_t ) );
+}
+
+static char *
+transform_table_path( const char *dir, const table_params_t *params ) /* {{{ */
+{
+	char *path = malloc( strlen( dir ) + 32 );
+	if ( !path )
+		die( "Cannot allocate path memory" );
+
+	sprintf( path, "%s/bender-%016llx.tt", dir,
+			(unsigned long long) transform_table_key( params ) );
+
+	return path;
+} /* }}} */
+
+/* returns NULL if there is no usable table in the file */
+static transform_table_t *
+transform_table_from_file( const char *filename, const table_params_t *params ) /* {{{ */
+{
+	transform_file_header_t header;
+	transform_table_t *tt;
+	struct stat st;
+	uint64_t count;
+	void *map;
+	int fd;
+
+	fd = open( filename, O_RDONLY );
+	if ( fd < 0 )
+		return NULL;
+
+	if ( fstat( fd, &st ) || st.st_size < sizeof( header )
+			|| read( fd, &header, sizeof( header ) ) != sizeof( header ) )
+	{
+		close( fd );
+		return NULL;
+	}
+
+	count = header.patch_width * header.patch_height;
+	if ( memcmp( header.magic, TRANSFORM_FILE_MAGIC, sizeof( header.magic ) )
+			|| header.size != st.st_size
+			|| header.size != sizeof( header )
+				+ transform_file_circles_size( count )
+				+ sizeof( bokeh_kernel_t ) * header.kernels_count
+				+ sizeof( double ) * header.weights_count
+				+ sizeof( int32_t ) * header.patch_height
+				+ sizeof( float ) * header.blur_count
+			|| ( header.blur_count
+				&& header.blur_count != header.box.width * header.box.height )
+			|| memcmp( &header.params, params, sizeof( table_params_t ) ) )
+	{
+		printf( "Warning, ignoring stale transform table '%s'\n", filename );
+		close( fd );
+		return NULL;
+	}
+
+	map = mmap( NULL, header.size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( map == MAP_FAILED )
+		return NULL;
+
+	tt = malloc( sizeof( transform_table_t ) );
+	if ( !tt )
+		die( "Cannot allocate transform table memory" );
+
+	tt->output_width = header.output_width;
+	tt->output_height = header.output_height;
+	tt->patch_width = header.patch_width;
+	tt->patch_height = header.patch_height;
+	tt->alpha_fix = header.alpha_fix;
+	tt->box = header.box;
+	tt->circles = (bokeh_circle_t *) ( (char *) map + sizeof( header ) );
+	tt->kernels = (bokeh_kernel_t *) ( (char *) tt->circles
+			+ transform_file_circles_size( count ) );
+	tt->kernels_count = header.kernels_count;
+	tt->weights = (double *) ( tt->kernels + tt->kernels_count );
+	tt->weights_count = header.weights_count;
+	tt->row_out_first = (int32_t *) ( tt->weights + tt->weights_count );
+	tt->window_rows = header.window_rows;
+	tt->blur = header.blur_count
+		? (float *) ( tt->row_out_first + tt->patch_height ) : NULL;
+	tt->circles_dropped = header.circles_dropped;
+	tt->circles_clipped = header.circles_clipped;
+	tt->map = map;
+	tt->map_size = header.size;
+
+	return tt;
+} /* }}} */
+
+/*
+ * Cache files are written to a temporary file and renamed, so readers never
+ * see partial ones. Returns NULL and warns if the file cannot be created.
+ */
+static FILE *
+cache_file_create( const char *filename, char **tmp_name ) /* {{{ */
+{
+	FILE *fp;
+	int fd;
+
+	*tmp_name = malloc( strlen( filename ) + 8 );
+	if ( !*tmp_name )
+		die( "Cannot allocate path memory" );
+	sprintf( *tmp_name, "%s.XXXXXX", filename );
+
+	fd = mkstemp( *tmp_name );
+	if ( fd < 0 || fchmod( fd, 0644 ) || !( fp = fdopen( fd, "wb" ) ) )
+	{
+		printf( "Warning, cannot create cache file '%s'\n", *tmp_name );
+		if ( fd >= 0 )
+		{
+			close( fd );
+			unlink( *tmp_name );
+		}
+		free( *tmp_name );
+		*tmp_name = NULL;
+		return NULL;
+	}
+
+	return fp;
+} /* }}} */
+
+static void
+cache_file_commit( FILE *fp, char **tmp_name, const char *filename ) /* {{{ */
+{
+	if ( ferror( fp ) | fclose( fp ) || rename( *tmp_name, filename ) )
+	{
+		printf( "Warning, cannot write cache file '%s'\n", filename );
+		unlink( *tmp_name );
+	}
+
+	free( *tmp_name );
+	*tmp_name = NULL;
+} /* }}} */
+
+static void
+transform_table_write( const transform_table_t *tt, const char *filename,
+		const table_params_t *params ) /* {{{ */
+{
+	transform_file_header_t header;
+	uint64_t count = tt->patch_width * tt->patch_height;
+	static const char pad[ sizeof( double ) ];
+	char *tmp_name;
+	FILE *fp;
+
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, TRANSFORM_FILE_MAGIC, sizeof( header.magic ) );
+	header.key = transform_table_key( params );
+	header.params = *params;
+	header.output_width = tt->output_width;
+	header.output_height = tt->output_height;
+	header.patch_width = tt->patch_width;
+	header.patch_height = tt->patch_height;
+	header.alpha_fix = tt->alpha_fix;
+	header.box = tt->box;
+	header.kernels_count = tt->kernels_count;
+	header.weights_count = tt->weights_count;
+	header.window_rows = tt->window_rows;
+	header.blur_count = tt->blur ? tt->box.width * tt->box.height : 0;
+	header.circles_dropped = tt->circles_dropped;
+	header.circles_clipped = tt->circles_clipped;
+	header.size = sizeof( header ) + transform_file_circles_size( count )
+		+ sizeof( bokeh_kernel_t ) * tt->kernels_count
+		+ sizeof( double ) * tt->weights_count
+		+ sizeof( int32_t ) * tt->patch_height
+		+ sizeof( float ) * header.blur_count;
+
+	fp = cache_file_create( filename, &tmp_name );
+	if ( !fp )
+		return;
+
+	fwrite( &header, sizeof( header ), 1, fp );
+	fwrite( tt->circles, sizeof( bokeh_circle_t ), count, fp );
+	fwrite( pad, 1, transform_file_circles_size( count )
+			- sizeof( bokeh_circle_t ) * count, fp );
+	fwrite( tt->kernels, sizeof( bokeh_kernel_t ), tt->kernels_count, fp );
+	fwrite( tt->weights, sizeof( double ), tt->weights_count, fp );
+	fwrite( tt->row_out_first, sizeof( int32_t ), tt->patch_height, fp );
+	if ( header.blur_count )
+		fwrite( tt->blur, sizeof( float ), header.blur_count, fp );
+
+	cache_file_commit( fp, &tmp_name, filename );
+} /* }}} */
+
+/*
+ * Point grid files, next to the tables, so a new focus only needs the bokeh
+ * stage in a later run as well:
+ *
+ *   point_grid_header_t
+ *   coord_t points[ height * width ]
+ */
+#define POINT_GRID_MAGIC "BENDPG01"
+
+typedef struct point_grid_header_s
+{
+	char magic[8];
+	grid_params_t params;
+	uint64_t width;
+	uint64_t height;
+} point_grid_header_t;
+
+static char *
+point_grid_path( const char *dir, const grid_params_t *gp ) /* {{{ */
+{
+	char *path = malloc( strlen( dir ) + 32 );
+	if ( !path )
+		die( "Cannot allocate path memory" );
+
+	sprintf( path, "%s/bender-%016llx.pg", dir,
+			(unsigned long long) fnv1a( gp, sizeof( grid_params_t ) ) );
+
+	return path;
+} /* }}} */
+
+/* returns NULL if there is no usable grid in the file */
+static point_grid_t *
+point_grid_from_file( const char *filename, const grid_params_t *gp ) /* {{{ */
+{
+	point_grid_header_t header;
+	point_grid_t *grid;
+	struct stat st;
+	unsigned int mark;
+	FILE *fp;
+
+	fp = fopen( filename, "rb" );
+	if ( !fp )
+		return NULL;
+	mark = die_hold( fp, file_release );
+
+	if ( fstat( fileno( fp ), &st )
+			|| fread( &header, sizeof( header ), 1, fp ) != 1
+			|| memcmp( header.magic, POINT_GRID_MAGIC, sizeof( header.magic ) )
+			|| memcmp( &header.params, gp, sizeof( grid_params_t ) )
+			|| st.st_size != sizeof( header )
+				+ sizeof( coord_t ) * header.width * header.height )
+	{
+		printf( "Warning, ignoring stale point grid '%s'\n", filename );
+		die_unhold( mark );
+		fclose( fp );
+		return NULL;
+	}
+
+	grid = calloc( 1, sizeof( point_grid_t ) );
+	if ( !grid )
+		die( "Cannot allocate point grid memory" );
+	die_hold( &grid, point_grid_release );
+	grid->params = header.params;
+	grid->width = header.width;
+	grid->height = header.height;
+	grid->points = malloc( sizeof( coord_t ) * grid->width * grid->height );
+	if ( !grid->points )
+		die( "Cannot allocate point grid memory" );
+	if ( fread( grid->points, sizeof( coord_t ), grid->width * grid->height, fp )
+			!= grid->width * grid->height )
+		destroy_point_grid( &grid );
+	die_unhold( mark );
+	fclose( fp );
+
+	return grid;
+} /* }}} */
+
+static void
+point_grid_write( const point_grid_t *grid, const char *filename ) /* {{{ */
+{
+	point_grid_header_t header;
+	char *tmp_name;
+	FILE *fp;
+
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, POINT_GRID_MAGIC, sizeof( header.magic ) );
+	header.params = grid->params;
+	header.width = grid->width;
+	header.height = grid->height;
+
+	fp = cache_file_create( filename, &tmp_name );
+	if ( !fp )
+		return;
+
+	fwrite( &header, sizeof( header ), 1, fp );
+	fwrite( grid->points, sizeof( coord_t ), grid->width * grid->height, fp );
+
+	cache_file_commit( fp, &tmp_name, filename );
+} /* }}} */
+
+/*
+ * The last point grid and the rows it was built from. A table differing
+ * only in focus, output size or quantization reuses the grid, one differing
+ * in angles or patch width reuses the rows.
+ */
+typedef struct geometry_cache_s
+{
+	table_rows_t *rows;
+	point_grid_t *grid;
+} geometry_cache_t;
+
+/* the grid for params, source tells where it came from */
+static const point_grid_t *
+geometry_cache_grid( geometry_cache_t *gc, const table_params_t *params,
+		const char *cache_dir, workers_t *workers, const char **source ) /* {{{ */
+{
+	grid_params_t gp, rp;
+	char *path = NULL;
+	unsigned int mark = die_holds_count;
+
+	grid_params_set( &gp, params );
+	if ( gc->grid && !memcmp( &gc->grid->params, &gp, sizeof( gp ) ) )
+	{
+		*source = "memory";
+		return gc->grid;
+	}
+	if ( gc->grid )
+		destroy_point_grid( &gc->grid );
+
+	if ( cache_dir )
+	{
+		path = point_grid_path( cache_dir, &gp );
+		mark = die_hold( path, free );
+		gc->grid = point_grid_from_file( path, &gp );
+		*source = "file";
+	}
+	if ( !gc->grid )
+	{
+		rows_params_set( &rp, &gp );
+		if ( gc->rows && !memcmp( &gc->rows->params, &rp, sizeof( rp ) ) )
+		{
+			*source = "rows";
+		}
+		else
+		{
+			if ( gc->rows )
+				destroy_table_rows( &gc->rows );
+			gc->rows = calc_table_rows( &rp );
+			*source = "built";
+		}
+		gc->grid = calc_point_grid( &gp, gc->rows, workers );
+		if ( path )
+			point_grid_write( gc->grid, path );
+	}
+	die_unhold( mark );
+	free( path );
+
+	return gc->grid;
+} /* }}} */
+
+static void
+geometry_cache_clear( geometry_cache_t *gc ) /* {{{ */
+{
+	if ( gc->grid )
+		destroy_point_grid( &gc->grid );
+	if ( gc->rows )
+		destroy_table_rows( &gc->rows );
+} /* }}} */
+
+/*
+ * Gather table: the transform table turned inside out.
+ *
+ * For every output pixel it lists which patch pixels land on it and with
+ * what kernel weight, as a sparse matrix in CSR form. Rendering then reads
+ * the inputs and writes each output pixel exactly once, so output rows can
+ * be rendered independently of each other.
+ * Kernels are already clipped to the output, see calc_clip_circles().
+ */
+typedef struct gather_tap_s
+{
+	uint32_t input; /* y * patch_width + x */
+	float weight;
+} gather_tap_t;
+
+typedef struct gather_table_s
+{
+	/* output pixels are those of the table box */
+	unsigned long int box_width;
+	unsigned long int box_height;
+	unsigned long int patch_width;
+	unsigned long int patch_height;
+	double alpha_fix;
+	/* taps of output pixel i are taps[ start[ i ] ] .. taps[ start[ i + 1 ] - 1 ] */
+	uint64_t *start;
+	gather_tap_t *taps;
+} gather_table_t;
+
+/*
+ * Walks all kernel taps landing on the output. Without fill it only counts
+ * taps per output pixel into start[ i + 1 ], with fill it stores the taps
+ * at fill[ i ]++.
+ */
+static void
+gather_table_pass( const transform_table_t *tt, gather_table_t *gt,
+		uint64_t *fill ) /* {{{ */
+{
+	unsigned long int x, y, bx, by;
+
+	for ( y = 0; y < tt->patch_height; y++ )
+	{
+		for ( x = 0; x < tt->patch_width; x++ )
+		{
+			const bokeh_circle_t *bokeh = tt->circles + y * tt->patch_width + x;
+			const bokeh_kernel_t *kernel = tt->kernels + bokeh->kernel;
+			const double *weight = tt->weights + kernel->offset;
+
+			for ( by = 0; by < kernel->height; by++ )
+			{
+				unsigned long int oy = bokeh->outy + by;
+
+				for ( bx = 0; bx < kernel->width; bx++ )
+				{
+					unsigned long int ox = bokeh->outx + bx;
+					unsigned long int out = oy * tt->box.width + ox;
+
+					if ( fill )
+					{
+						gather_tap_t *tap = gt->taps + fill[ out ]++;
+						tap->input = y * tt->patch_width + x;
+						tap->weight = weight[ by * kernel->width + bx ];
+					}
+					else
+					{
+						gt->start[ out + 1 ]++;
+					}
+				}
+			}
+		}
+	}
+} /* }}} */
+
+static gather_table_t *
+calc_gather_table( const transform_table_t *tt ) /* {{{ */
+{
+	gather_table_t *gt;
+	unsigned long int i, outputs;
+	uint64_t total = 0, *fill;
+
+	gt = malloc( sizeof( gather_table_t ) );
+	if ( !gt )
+		die( "Cannot allocate gather table memory" );
+	gt->box_width = tt->box.width;
+	gt->box_height = tt->box.height;
+	gt->patch_width = tt->patch_width;
+	gt->patch_height = tt->patch_height;
+	gt->alpha_fix = tt->alpha_fix;
+
+	outputs = tt->box.width * tt->box.height;
+	gt->start = calloc( sizeof( uint64_t ), outputs + 1 );
+	if ( !gt->start )
+		die( "Cannot allocate gather table memory" );
+
+	/* count taps of every output pixel, then turn counts into starts */
+	gather_table_pass( tt, gt, NULL );
+	for ( i = 0; i < outputs; i++ )
+	{
+		total += gt->start[ i + 1 ];
+		gt->start[ i + 1 ] = total;
+	}
+
+	gt->taps = malloc( sizeof( gather_tap_t ) * total );
+	fill = malloc( sizeof( uint64_t ) * outputs );
+	if ( !gt->taps || !fill )
+		die( "Cannot allocate %llu gather taps", (unsigned long long) total );
+	memcpy( fill, gt->start, sizeof( uint64_t ) * outputs );
+
+	gather_table_pass( tt, gt, fill );
+	free( fill );
+
+	return gt;
+} /* }}} */
+
+static void
+destroy_gather_table( gather_table_t **gt )
+{
+	free( (*gt)->start );
+	free( (*gt)->taps );
+	free( *gt );
+	*gt = NULL;
+}
+
+static size_t
+gather_table_bytes( const gather_table_t *gt ) /* {{{ */
+{
+	uint64_t pixels = gt->box_width * gt->box_height;
+	return sizeof( uint64_t ) * ( pixels + 1 )
+		+ sizeof( gather_tap_t ) * gt->start[ pixels ];
+} /* }}} */
+
+/*
+ * Scatter accumulator precision.
+ *
+ * ACCUM_DOUBLE - pixel_partial_t, 32 bytes per output pixel, the reference.
+ * ACCUM_FLOAT  - pixel_partial_f_t, 16 bytes. Sums stay within about 1e-6
+ *                relative error of the double ones, output is the same but
+ *                for rare off-by-one roundings.
+ * ACCUM_FIXED  - pixel_partial_i_t, 16 bytes. Kernel weights are prescaled
+ *                by alpha_fix and 2^FIXED_SHIFT and rounded to integers
+ *                (calc_fixed_weights()), colors are premultiplied to 8 bits
+ *                before splatting. Against the double output, alpha and
+ *                premultiplied color are off by at most
+ *                0.5 + taps / 2^( FIXED_SHIFT + 1 ) * 255 levels (under one
+ *                level for the ~100 taps reaching a pixel); un-premultiplied
+ *                color can be off more where alpha is tiny. Sums overflow
+ *                only if weights reaching one output pixel add up to more
+ *                than 256, i.e. more than 256 / alpha_fix fully opaque
+ *                patch pixels land on it.
+ */
+typedef enum
+{
+	ACCUM_DOUBLE,
+	ACCUM_FLOAT,
+	ACCUM_FIXED,
+} accum_t;
+
+#define FIXED_SHIFT 16
+
+static const size_t accum_size[] = {
+	sizeof( pixel_partial_t ),
+	sizeof( pixel_partial_f_t ),
+	sizeof( pixel_partial_i_t ),
+};
+
+static const char *accum_names[] = { "double", "float", "fixed" };
+
+static uint32_t *
+calc_fixed_weights( const transform_table_t *tt ) /* {{{ */
+{
+	uint32_t *fixed;
+	size_t i;
+	double scale = tt->alpha_fix * ( 1 << FIXED_SHIFT );
+
+	fixed = malloc( sizeof( uint32_t ) * tt->weights_count );
+	if ( !fixed )
+		die( "Cannot allocate fixed point weight memory" );
+	for ( i = 0; i < tt->weights_count; i++ )
+		fixed[ i ] = lround( tt->weights[ i ] * scale );
+
+	return fixed;
+} /* }}} */
+
+/* partial sums of any precision as pixel_partial_t */
+static inline void
+accum_get( accum_t accum, const void *acc, unsigned long int i,
+		pixel_partial_t *p ) /* {{{ */
+{
+	if ( accum == ACCUM_FLOAT )
+	{
+		const pixel_partial_f_t *f = (const pixel_partial_f_t *) acc + i;
+		p->r = f->r;
+		p->g = f->g;
+		p->b = f->b;
+		p->a = f->a;
+	}
+	else if ( accum == ACCUM_FIXED )
+	{
+		const pixel_partial_i_t *f = (const pixel_partial_i_t *) acc + i;
+		p->r = f->r * ( 1.0 / ( 1 << FIXED_SHIFT ) );
+		p->g = f->g * ( 1.0 / ( 1 << FIXED_SHIFT ) );
+		p->b = f->b * ( 1.0 / ( 1 << FIXED_SHIFT ) );
+		p->a = f->a * ( 1.0 / ( 255.0 * ( 1 << FIXED_SHIFT ) ) );
+	}
+	else
+	{
+		*p = ( (const pixel_partial_t *) acc )[ i ];
+	}
+} /* }}} */
+
+/* acc[ i ] += add[ i ] for n pixels */
+static void
+accum_add( accum_t accum, void *acc, const void *add, unsigned long int n ) /* {{{ */
+{
+	unsigned long int i;
+
+	if ( accum == ACCUM_FIXED )
+	{
+		uint32_t *a = acc;
+		const uint32_t *b = add;
+		for ( i = 0; i < n * 4; i++ )
+			a[ i ] += b[ i ];
+	}
+	else if ( accum == ACCUM_FLOAT )
+	{
+		float *a = acc;
+		const float *b = add;
+		for ( i = 0; i < n * 4; i++ )
+			a[ i ] += b[ i ];
+	}
+	else
+	{
+		double *a = acc;
+		const double *b = add;
+		for ( i = 0; i < n * 4; i++ )
+			a[ i ] += b[ i ];
+	}
+} /* }}} */
+
+/*
+ * Splat row kernels: out[ i ] += w[ i ] * v for n RGBA pixels, where v is
+ * the premultiplied input pixel ( alpha * r, alpha * g, alpha * b, alpha ).
+ * All variants do the same multiply and add per channel in the same order,
+ * so every level gives bit-identical sums.
+ */
+typedef struct splat_funcs_s
+{
+	const char *name;
+	void (*row_d)( double * restrict out, const double * restrict w,
+			unsigned long int n, const double * restrict v );
+	void (*row_f)( float * restrict out, const double * restrict w,
+			unsigned long int n, const float * restrict v );
+	void (*row_i)( uint32_t * restrict out, const uint32_t * restrict w,
+			unsigned long int n, const uint32_t * restrict v );
+} splat_funcs_t;
+
+static void
+splat_row_d_scalar( double * restrict out, const double * restrict w,
+		unsigned long int n, const double * restrict v ) /* {{{ */
+{
+	unsigned long int i;
+	for ( i = 0; i < n; i++, out += 4 )
+	{
+		out[0] += w[ i ] * v[0];
+		out[1] += w[ i ] * v[1];
+		out[2] += w[ i ] * v[2];
+		out[3] += w[ i ] * v[3];
+	}
+} /* }}} */
+
+static void
+splat_row_f_scalar( float * restrict out, const double * restrict w,
+		unsigned long int n, const float * restrict v ) /* {{{ */
+{
+	unsigned long int i;
+	for ( i = 0; i < n; i++, out += 4 )
+	{
+		float wf = w[ i ];
+		out[0] += wf * v[0];
+		out[1] += wf * v[1];
+		out[2] += wf * v[2];
+		out[3] += wf * v[3];
+	}
+} /* }}} */
+
+static void
+splat_row_i_scalar( uint32_t * restrict out, const uint32_t * restrict w,
+		unsigned long int n, const uint32_t * restrict v ) /* {{{ */
+{
+	unsigned long int i;
+	for ( i = 0; i < n; i++, out += 4 )
+	{
+		out[0] += w[ i ] * v[0];
+		out[1] += w[ i ] * v[1];
+		out[2] += w[ i ] * v[2];
+		out[3] += w[ i ] * v[3];
+	}
+} /* }}} */
+
+#ifdef HAVE_X86_SIMD
+__attribute__ (( target( "sse2" ) ))
+static void
+splat_row_d_sse2( double * restrict out, const double * restrict w,
+		unsigned long int n, const double * restrict v ) /* {{{ */
+{
+	__m128d v_rg = _mm_loadu_pd( v ), v_ba = _mm_loadu_pd( v + 2 );
+	unsigned long int i;
+	for ( i = 0; i < n; i++, out += 4 )
+	{
+		__m128d wi = _mm_set1_pd( w[ i ] );
+		_mm_storeu_pd( out, _mm_add_pd( _mm_loadu_pd( out ), _mm_mul_pd( wi, v_rg ) ) );
+		_mm_storeu_pd( out + 2, _mm_add_pd( _mm_loadu_pd( out + 2 ), _mm_mul_pd( wi, v_ba ) ) );
+	}
+} /* }}} */
+
+__attribute__ (( target( "sse2" ) ))
+static void
+splat_row_f_sse2( float * restrict out, const double * restrict w,
+		unsigned long int n, const float * restrict v ) /* {{{ */
+{
+	__m128 vv = _mm_loadu_ps( v );
+	unsigned long int i;
+	for ( i = 0; i < n; i++, out += 4 )
+	{
+		__m128 wi = _mm_set1_ps( w[ i ] );
+		_mm_storeu_ps( out, _mm_add_ps( _mm_loadu_ps( out ), _mm_mul_ps( wi, vv ) ) );
+	}
+} /* }}} */
+
+__attribute__ (( target( "avx2" ) ))
+static void
+splat_row_d_avx2( double * restrict out, const double * restrict w,
+		unsigned long int n, const double * restrict v ) /* {{{ */
+{
+	__m256d vv = _mm256_loadu_pd( v );
+	unsigned long int i;
+	for ( i = 0; i < n; i++, out += 4 )
+	{
+		__m256d wi = _mm256_set1_pd( w[ i ] );
+		_mm256_storeu_pd( out, _mm256_add_pd( _mm256_loadu_pd( out ), _mm256_mul_pd( wi, vv ) ) );
+	}
+} /* }}} */
+
+__attribute__ (( target( "avx2" ) ))
+static void
+splat_row_f_avx2( float * restrict out, const double * restrict w,
+		unsigned long int n, const float * restrict v ) /* {{{ */
+{
+	__m128 v4 = _mm_loadu_ps( v );
+	__m256 vv = _mm256_set_m128( v4, v4 );
+	unsigned long int i;
+	for ( i = 0; i + 1 < n; i += 2, out += 8 )
+	{
+		__m256 wi = _mm256_set_m128( _mm_set1_ps( w[ i + 1 ] ), _mm_set1_ps( w[ i ] ) );
+		_mm256_storeu_ps( out, _mm256_add_ps( _mm256_loadu_ps( out ), _mm256_mul_ps( wi, vv ) ) );
+	}
+	if ( i < n )
+	{
+		__m128 wi = _mm_set1_ps( w[ i ] );
+		_mm_storeu_ps( out, _mm_add_ps( _mm_loadu_ps( out ), _mm_mul_ps( wi, v4 ) ) );
+	}
+} /* }}} */
+
+__attribute__ (( target( "avx2" ) ))
+static void
+splat_row_i_avx2( uint32_t * restrict out, const uint32_t * restrict w,
+		unsigned long int n, const uint32_t * restrict v ) /* {{{ */
+{
+	__m128i v4 = _mm_loadu_si128( (const __m128i *) v );
+	__m256i vv = _mm256_set_m128i( v4, v4 );
+	unsigned long int i;
+	for ( i = 0; i + 1 < n; i += 2, out += 8 )
+	{
+		__m256i wi = _mm256_set_m128i( _mm_set1_epi32( w[ i + 1 ] ), _mm_set1_epi32( w[ i ] ) );
+		__m256i o = _mm256_loadu_si256( (const __m256i *) out );
+		_mm256_storeu_si256( (__m256i *) out, _mm256_add_epi32( o, _mm256_mullo_epi32( wi, vv ) ) );
+	}
+	if ( i < n )
+	{
+		__m128i wi = _mm_set1_epi32( w[ i ] );
+		__m128i o = _mm_loadu_si128( (const __m128i *) out );
+		_mm_storeu_si128( (__m128i *) out, _mm_add_epi32( o, _mm_mullo_epi32( wi, v4 ) ) );
+	}
+} /* }}} */
+
+__attribute__ (( target( "avx512f" ) ))
+static void
+splat_row_d_avx512( double * restrict out, const double * restrict w,
+		unsigned long int n, const double * restrict v ) /* {{{ */
+{
+	__m256d v4 = _mm256_loadu_pd( v );
+	__m512d vv = _mm512_broadcast_f64x4( v4 );
+	unsigned long int i;
+	for ( i = 0; i + 1 < n; i += 2, out += 8 )
+	{
+		__m512d wi = _mm512_insertf64x4( _mm512_set1_pd( w[ i ] ),
+				_mm256_set1_pd( w[ i + 1 ] ), 1 );
+		_mm512_storeu_pd( out, _mm512_add_pd( _mm512_loadu_pd( out ), _mm512_mul_pd( wi, vv ) ) );
+	}
+	if ( i < n )
+	{
+		__m256d wi = _mm256_set1_pd( w[ i ] );
+		_mm256_storeu_pd( out, _mm256_add_pd( _mm256_loadu_pd( out ), _mm256_mul_pd( wi, v4 ) ) );
+	}
+} /* }}} */
+
+__attribute__ (( target( "avx512f" ) ))
+static void
+splat_row_f_avx512( float * restrict out, const double * restrict w,
+		unsigned long int n, const float * restrict v ) /* {{{ */
+{
+	__m128 v4 = _mm_loadu_ps( v );
+	__m512 vv = _mm512_broadcast_f32x4( v4 );
+	unsigned long int i;
+	for ( i = 0; i + 3 < n; i += 4, out += 16 )
+	{
+		/* w[ i ] .. w[ i + 3 ] as floats, each repeated for 4 channels */
+		__m128 w4 = _mm256_cvtpd_ps( _mm256_loadu_pd( w + i ) );
+		__m512 wi = _mm512_permutexvar_ps( _mm512_set_epi32(
+					3, 3, 3, 3, 2, 2, 2, 2, 1, 1, 1, 1, 0, 0, 0, 0 ),
+				_mm512_castps128_ps512( w4 ) );
+		_mm512_storeu_ps( out, _mm512_add_ps( _mm512_loadu_ps( out ), _mm512_mul_ps( wi, vv ) ) );
+	}
+	for ( ; i < n; i++, out += 4 )
+	{
+		__m128 wi = _mm_set1_ps( w[ i ] );
+		_mm_storeu_ps( out, _mm_add_ps( _mm_loadu_ps( out ), _mm_mul_ps( wi, v4 ) ) );
+	}
+} /* }}} */
+
+__attribute__ (( target( "avx512f" ) ))
+static void
+splat_row_i_avx512( uint32_t * restrict out, const uint32_t * restrict w,
+		unsigned long int n, const uint32_t * restrict v ) /* {{{ */
+{
+	__m128i v4 = _mm_loadu_si128( (const __m128i *) v );
+	__m512i vv = _mm512_broadcast_i32x4( v4 );
+	unsigned long int i;
+	for ( i = 0; i + 3 < n; i += 4, out += 16 )
+	{
+		__m512i wi = _mm512_permutexvar_epi32( _mm512_set_epi32(
+					3, 3, 3, 3, 2, 2, 2, 2, 1, 1, 1, 1, 0, 0, 0, 0 ),
+				_mm512_castsi128_si512( _mm_loadu_si128( (const __m128i *) ( w + i ) ) ) );
+		__m512i o = _mm512_loadu_si512( out );
+		_mm512_storeu_si512( out, _mm512_add_epi32( o, _mm512_mullo_epi32( wi, vv ) ) );
+	}
+	for ( ; i < n; i++, out += 4 )
+	{
+		__m128i wi = _mm_set1_epi32( w[ i ] );
+		__m128i o = _mm_loadu_si128( (const __m128i *) out );
+		_mm_storeu_si128( (__m128i *) out, _mm_add_epi32( o, _mm_mullo_epi32( wi, v4 ) ) );
+	}
+} /* }}} */
+#endif
+
+/* ordered from the slowest, SSE2 has no 32-bit multiply so fixed stays scalar */
+static const splat_funcs_t splat_levels[] = {
+	{ "scalar", splat_row_d_scalar, splat_row_f_scalar, splat_row_i_scalar },
+#ifdef HAVE_X86_SIMD
+	{ "sse2", splat_row_d_sse2, splat_row_f_sse2, splat_row_i_scalar },
+	{ "avx2", splat_row_d_avx2, splat_row_f_avx2, splat_row_i_avx2 },
+	{ "avx512", splat_row_d_avx512, splat_row_f_avx512, splat_row_i_avx512 },
+#endif
+};
+
+static bool
+splat_supported( const splat_funcs_t *splat ) /* {{{ */
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if ( !strcmp( splat->name, "sse2" ) )
+		return __builtin_cpu_supports( "sse2" );
+	if ( !strcmp( splat->name, "avx2" ) )
+		return __builtin_cpu_supports( "avx2" );
+	if ( !strcmp( splat->name, "avx512" ) )
+		return __builtin_cpu_supports( "avx512f" );
+#endif
+	return true;
+} /* }}} */
+
+/* best level supported by this CPU, or the named one */
+static const splat_funcs_t *
+splat_select( const char *name ) /* {{{ */
+{
+	const splat_funcs_t *best = splat_levels;
+	unsigned int i;
+
+	for ( i = 0; i < sizeof( splat_levels ) / sizeof( splat_levels[0] ); i++ )
+	{
+		const splat_funcs_t *splat = splat_levels + i;
+		if ( name && strcmp( name, splat->name ) )
+			continue;
+		if ( !splat_supported( splat ) )
+		{
+			if ( name )
+				die( "This CPU does not support %s", name );
+			continue;
+		}
+		best = splat;
+		if ( name )
+			return best;
+	}
+	if ( name && strcmp( name, best->name ) )
+		die( "Unknown splat kernel '%s'", name );
+
+	return best;
+} /* }}} */
+
+/* ENGINE_SAT is the scatter engine on tables with a blur map */
+typedef enum
+{
+	ENGINE_SCATTER,
+	ENGINE_GATHER,
+	ENGINE_SAT,
+} render_engine_t;
+
+static const char *engine_names[] = { "scatter", "gather", "sat" };
+
+typedef struct render_opts_s
+{
+	render_engine_t engine;
+	/* NULL renders in the calling thread only */
+	workers_t *workers;
+	/* scatter accumulator precision, fixed_weights for ACCUM_FIXED */
+	accum_t accum;
+	uint32_t *fixed_weights;
+	/* scatter row kernels, see splat_select() */
+	const splat_funcs_t *splat;
+	/* built from the transform table for ENGINE_GATHER */
+	gather_table_t *gather;
+	/* applied while images are written */
+	output_opts_t output;
+	/* JSON lines with image_stats_t of every image go here if set */
+	FILE *stats;
+} render_opts_t;
+
+static inline void
+pixel_normalize( const pixel_partial_t * restrict p_in, pixel_rgba_t * restrict p_out ) /* {{{ */
+{
+	if ( ! p_in->a )
+		return;
+
+	double fix = 1 / p_in->a;
+	if ( p_in->a > 1 )
+	{
+		p_out->a = 255;
+	}
+	else
+	{
+		p_out->a = 255 * p_in->a;
+	}
+
+	p_out->r = p_in->r * fix;
+	p_out->g = p_in->g * fix;
+	p_out->b = p_in->b * fix;
+} /* }}} */
+
+/*
+ * Scatter rendering splits the input rows into bands. Every band splats
+ * into its own accumulator, which covers only the output rows the band can
+ * reach, so bands never write to shared memory. Output rows are then summed
+ * over all bands covering them and normalized, again in parallel.
+ */
+typedef struct scatter_band_s
+{
+	long int y_start;
+	long int y_stop;
+	/* accumulator covers output rows out_start .. out_stop - 1 */
+	unsigned long int out_start;
+	unsigned long int out_stop;
+	/* if set, acc is a ring of ring_rows rows and row y lives in y % ring_rows */
+	unsigned long int ring_rows;
+	void *acc;
+	/* see image_stats_t */
+	uint64_t taps;
+	uint64_t skipped;
+} scatter_band_t;
+
+typedef struct scatter_job_s
+{
+	const transform_table_t *tt;
+	accum_t accum;
+	/* for ACCUM_FIXED */
+	const uint32_t *fixed_weights;
+	const splat_funcs_t *splat;
+	image_input_t *input;
+	long int do_width;
+	long int move_x;
+	scatter_band_t *bands;
+	unsigned int bands_count;
+	/* summed-area table, see scatter_rows_sat() */
+	pixel_partial_t *sat;
+	image_file_t *img_out;
+} scatter_job_t;
+
+/* frees the bands, their accumulators and the summed-area table */
+static void
+scatter_job_release( void *arg ) /* {{{ */
+{
+	scatter_job_t *sj = arg;
+	unsigned int b;
+
+	for ( b = 0; b < sj->bands_count; b++ )
+		free( sj->bands[ b ].acc );
+	free( sj->bands );
+	free( sj->sat );
+} /* }}} */
+
+/* accumulator row of output row y */
+static inline char *
+scatter_band_row( const scatter_band_t *band, size_t row_size, unsigned long int y )
+{
+	if ( band->ring_rows )
+		return (char *) band->acc + ( y % band->ring_rows ) * row_size;
+	return (char *) band->acc + ( y - band->out_start ) * row_size;
+}
+
+/* splats one kernel, it lies within the output, see calc_clip_circles() */
+static inline void
+scatter_kernel_splat( const scatter_job_t *sj, const scatter_band_t *band,
+		size_t row_size, const bokeh_circle_t *bokeh, const bokeh_kernel_t *kernel,
+		const void *weights, const void *v )
+{
+	const splat_funcs_t *splat = sj->splat;
+	long int ox = bokeh->outx, by;
+
+	for ( by = 0; by < kernel->height; by++ )
+	{
+		char *row = scatter_band_row( band, row_size, bokeh->outy + by );
+		if ( sj->accum == ACCUM_FLOAT )
+			splat->row_f( (float *) row + 4 * ox,
+				(const double *) weights + by * kernel->width, kernel->width, v );
+		else if ( sj->accum == ACCUM_FIXED )
+			splat->row_i( (uint32_t *) row + 4 * ox,
+				(const uint32_t *) weights + by * kernel->width, kernel->width, v );
+		else
+			splat->row_d( (double *) row + 4 * ox,
+				(const double *) weights + by * kernel->width, kernel->width, v );
+	}
+}
+
+/* splats patch rows y_start .. y_stop - 1 into the band accumulator */
+static void
+scatter_band_rows( const scatter_job_t *sj, scatter_band_t *band,
+		long int y_start, long int y_stop ) /* {{{ */
+{
+	const transform_table_t *transform_table = sj->tt;
+	size_t row_size = accum_size[ sj->accum ] * transform_table->box.width;
+	uint64_t taps = 0, skipped = 0;
+	long int x, y;
+
+	for ( y = y_start; y < y_stop; y++ )
+	{
+		const bokeh_circle_t *bc_row;
+		const pixel_rgba_t *in_row;
+		const pixel_span_t *spans;
+		size_t s, spans_count;
+		long int painted = 0;
+
+		bc_row = transform_table->circles + y * transform_table->patch_width;
+		/* transparent pixels add nothing in any accumulator, only spans are walked */
+		spans = image_input_spans( sj->input, y, &spans_count );
+		in_row = image_input_row( sj->input, y );
+
+		for ( s = 0; s < spans_count; s++ )
+		{
+			long int x_start = spans[ s ].start, x_stop = spans[ s ].stop;
+			if ( x_start < sj->move_x )
+				x_start = sj->move_x;
+			if ( x_stop > sj->do_width )
+				x_stop = sj->do_width;
+			if ( x_stop > x_start )
+				painted += x_stop - x_start;
+
+			for ( x = x_start; x < x_stop; x++ )
+			{
+				const bokeh_circle_t *bokeh = bc_row + x;
+				const bokeh_kernel_t *kernel = transform_table->kernels + bokeh->kernel;
+				const double *weight = transform_table->weights + kernel->offset;
+				const pixel_rgba_t *p_in;
+				p_in = in_row + x;
+
+				taps += kernel->width * kernel->height;
+
+				/* per input pixel factors, the row kernels only multiply and add */
+				if ( sj->accum == ACCUM_FLOAT )
+				{
+					float alpha = ( double ) p_in->a / 255.0 * transform_table->alpha_fix;
+					float v[4] = { alpha * p_in->r, alpha * p_in->g, alpha * p_in->b, alpha };
+					scatter_kernel_splat( sj, band, row_size, bokeh, kernel, weight, v );
+				}
+				else if ( sj->accum == ACCUM_FIXED )
+				{
+					const uint32_t *fixed = sj->fixed_weights + kernel->offset;
+					uint32_t a = p_in->a;
+					uint32_t v[4] = {
+						( a * p_in->r + 127 ) / 255,
+						( a * p_in->g + 127 ) / 255,
+						( a * p_in->b + 127 ) / 255,
+						a
+					};
+					scatter_kernel_splat( sj, band, row_size, bokeh, kernel, fixed, v );
+				}
+				else
+				{
+					double alpha = ( double ) p_in->a / 255.0 * transform_table->alpha_fix;
+					double v[4] = { alpha * p_in->r, alpha * p_in->g, alpha * p_in->b, alpha };
+					scatter_kernel_splat( sj, band, row_size, bokeh, kernel, weight, v );
+				}
+			}
+		}
+		if ( sj->do_width > sj->move_x )
+			skipped += sj->do_width - sj->move_x - painted;
+	}
+
+	band->taps += taps;
+	band->skipped += skipped;
+} /* }}} */
+
+static void
+scatter_bands_stats( const scatter_band_t *bands, unsigned int count,
+		accum_t accum, unsigned long int width, image_stats_t *stats ) /* {{{ */
+{
+	unsigned int b;
+
+	for ( b = 0; b < count; b++ )
+	{
+		const scatter_band_t *band = bands + b;
+		stats->taps += band->taps;
+		stats->skipped += band->skipped;
+		stats->accum_bytes += accum_size[ accum ] * width
+			* ( band->ring_rows ? band->ring_rows : band->out_stop - band->out_start );
+	}
+} /* }}} */
+
+static void
+scatter_band_splat( void *arg, unsigned long int job ) /* {{{ */
+{
+	scatter_job_t *sj = arg;
+	const transform_table_t *transform_table = sj->tt;
+	scatter_band_t *band = sj->bands + job;
+	long int x, y;
+
+	/* find output rows reachable from this band */
+	band->out_start = transform_table->box.height;
+	band->out_stop = 0;
+	for ( y = band->y_start; y < band->y_stop; y++ )
+	{
+		const bokeh_circle_t *bc_row;
+		bc_row = transform_table->circles + y * transform_table->patch_width;
+		for ( x = sj->move_x; x < sj->do_width; x++ )
+		{
+			const bokeh_circle_t *bokeh = bc_row + x;
+			unsigned long int height = transform_table->kernels[ bokeh->kernel ].height;
+			if ( !height )
+				continue;
+			if ( bokeh->outy < band->out_start )
+				band->out_start = bokeh->outy;
+			if ( bokeh->outy + height > band->out_stop )
+				band->out_stop = bokeh->outy + height;
+		}
+	}
+	if ( band->out_start >= band->out_stop )
+	{
+		band->out_start = band->out_stop = 0;
+		return;
+	}
+
+	band->acc = calloc( accum_size[ sj->accum ],
+			( band->out_stop - band->out_start ) * transform_table->box.width );
+	if ( !band->acc )
+		die( "Cannot allocate accumulator memory" );
+
+	scatter_band_rows( sj, band, band->y_start, band->y_stop );
+} /* }}} */
+
+/* sums output row y over all bands reaching it into the first one, NULL if none does */
+static char *
+scatter_row_sum( const scatter_job_t *sj, unsigned long int y ) /* {{{ */
+{
+	unsigned long int width = sj->tt->box.width;
+	char *first = NULL;
+	unsigned int b;
+
+	for ( b = 0; b < sj->bands_count; b++ )
+	{
+		const scatter_band_t *band = sj->bands + b;
+		char *acc;
+		if ( y < band->out_start || y >= band->out_stop )
+			continue;
+
+		acc = (char *) band->acc
+			+ ( y - band->out_start ) * width * accum_size[ sj->accum ];
+		if ( !first )
+			first = acc;
+		else
+			accum_add( sj->accum, first, acc, width );
+	}
+
+	return first;
+} /* }}} */
+
+static void
+scatter_rows_normalize( void *arg, unsigned long int job ) /* {{{ */
+{
+	scatter_job_t *sj = arg;
+	unsigned long int x, y, y_stop, width = sj->tt->box.width;
+
+	y_stop = ( job + 1 ) * ROWS_PER_JOB;
+	if ( y_stop > sj->tt->box.height )
+		y_stop = sj->tt->box.height;
+
+	for ( y = job * ROWS_PER_JOB; y < y_stop; y++ )
+	{
+		pixel_rgba_t *row = (pixel_rgba_t *) sj->img_out->row_pointers[ y ];
+		char *first = scatter_row_sum( sj, y );
+
+		if ( !first )
+			continue;
+		for ( x = 0; x < width; x++ )
+		{
+			pixel_partial_t p;
+			accum_get( sj->accum, first, x, &p );
+			pixel_normalize( &p, row + x );
+		}
+	}
+} /* }}} */
+
+/*
+ * Tables with a blur map, see calc_blur_map(). The summed rows go into a
+ * summed-area table of ( width + 1 ) x ( height + 1 ) pixels, pixel x, y of
+ * it holding the sum of all box pixels above and left of x, y. Then every
+ * output pixel is the mean of a disc of its own radius, built of
+ * SAT_DISC_STRIPS boxes of four lookups each, see sat_disc_strips(), 20
+ * lookups whatever the radius. The table is built along x in row jobs and
+ * along y in column jobs.
+ */
+#define SAT_COLUMNS_PER_JOB 256
+
+static inline pixel_partial_t *
+scatter_sat_row( const scatter_job_t *sj, unsigned long int y )
+{
+	return sj->sat + y * ( sj->tt->box.width + 1 );
+}
+
+static void
+scatter_rows_sat( void *arg, unsigned long int job ) /* {{{ */
+{
+	scatter_job_t *sj = arg;
+	unsigned long int x, y, y_stop, width = sj->tt->box.width;
+
+	y_stop = ( job + 1 ) * ROWS_PER_JOB;
+	if ( y_stop > sj->tt->box.height )
+		y_stop = sj->tt->box.height;
+
+	for ( y = job * ROWS_PER_JOB; y < y_stop; y++ )
+	{
+		pixel_partial_t *sat = scatter_sat_row( sj, y + 1 ), sum = { 0, 0, 0, 0 };
+		char *first = scatter_row_sum( sj, y );
+
+		sat[ 0 ] = sum;
+		for ( x = 0; x < width; x++ )
+		{
+			if ( first )
+			{
+				pixel_partial_t p;
+				accum_get( sj->accum, first, x, &p );
+				sum.r += p.r;
+				sum.g += p.g;
+				sum.b += p.b;
+				sum.a += p.a;
+			}
+			sat[ x + 1 ] = sum;
+		}
+	}
+} /* }}} */
+
+static void
+scatter_columns_sat( void *arg, unsigned long int job ) /* {{{ */
+{
+	scatter_job_t *sj = arg;
+	unsigned long int x, y, x_stop;
+
+	x_stop = ( job + 1 ) * SAT_COLUMNS_PER_JOB;
+	if ( x_stop > sj->tt->box.width + 1 )
+		x_stop = sj->tt->box.width + 1;
+
+	for ( y = 2; y <= sj->tt->box.height; y++ )
+	{
+		const pixel_partial_t *above = scatter_sat_row( sj, y - 1 );
+		pixel_partial_t *sat = scatter_sat_row( sj, y );
+		for ( x = job * SAT_COLUMNS_PER_JOB; x < x_stop; x++ )
+		{
+			sat[ x ].r += above[ x ].r;
+			sat[ x ].g += above[ x ].g;
+			sat[ x ].b += above[ x ].b;
+			sat[ x ].a += above[ x ].a;
+		}
+	}
+} /* }}} */
+
+static inline void
+pixel_partial_mix( pixel_partial_t * restrict out, const pixel_partial_t *a,
+		const pixel_partial_t *b, double f )
+{
+	out->r = a->r + f * ( b->r - a->r );
+	out->g = a->g + f * ( b->g - a->g );
+	out->b = a->b + f * ( b->b - a->b );
+	out->a = a->a + f * ( b->a - a->a );
+}
+
+/*
+ * Sums are bilinear within a pixel, pixel x covers x - 0.5 .. x + 0.5, so
+ * fractional box edges are exact. A horizontal edge at v is resolved once
+ * into the table rows around it.
+ */
+typedef struct sat_edge_s
+{
+	const pixel_partial_t *above;
+	const pixel_partial_t *below;
+	double f;
+} sat_edge_t;
+
+static inline void
+scatter_sat_edge( const scatter_job_t *sj, double v, sat_edge_t *e ) /* {{{ */
+{
+	unsigned long int yi, height = sj->tt->box.height;
+
+	v += 0.5;
+	if ( v < 0 )
+		v = 0;
+	else if ( v > height )
+		v = height;
+	/* the last pixel takes the far edge, so yi + 1 exists */
+	yi = v < height ? (unsigned long int) v : height - 1;
+
+	e->above = scatter_sat_row( sj, yi );
+	e->below = scatter_sat_row( sj, yi + 1 );
+	e->f = v - yi;
+} /* }}} */
+
+/* sum of the box above edge e and left of u */
+static inline void
+scatter_sat_lookup( const scatter_job_t *sj, const sat_edge_t *e, double u,
+		pixel_partial_t *p ) /* {{{ */
+{
+	unsigned long int xi, width = sj->tt->box.width;
+	pixel_partial_t left, right;
+
+	u += 0.5;
+	if ( u < 0 )
+		u = 0;
+	else if ( u > width )
+		u = width;
+	xi = u < width ? (unsigned long int) u : width - 1;
+
+	pixel_partial_mix( &left, e->above + xi, e->below + xi, e->f );
+	pixel_partial_mix( &right, e->above + xi + 1, e->below + xi + 1, e->f );
+	pixel_partial_mix( p, &left, &right, u - xi );
+} /* }}} */
+
+/*
+ * Discs are approximated by SAT_DISC_STRIPS boxes stacked along y. Strip i
+ * of a unit disc spans bound[ i ] .. bound[ i + 1 ] and has the area of the
+ * disc between them. Returns the area of the disc, pi.
+ */
+#define SAT_DISC_STRIPS 5
+
+static double
+sat_disc_strips( double bound[ SAT_DISC_STRIPS + 1 ], double half[ SAT_DISC_STRIPS ] ) /* {{{ */
+{
+	double total = 0;
+	unsigned int i;
+
+	for ( i = 0; i <= SAT_DISC_STRIPS; i++ )
+		bound[ i ] = 2.0 * i / SAT_DISC_STRIPS - 1;
+	for ( i = 0; i < SAT_DISC_STRIPS; i++ )
+	{
+		double y0 = bound[ i ], y1 = bound[ i + 1 ];
+		/* integral of 2 sqrt( 1 - y^2 ) */
+		double area = y1 * sqrt( 1 - y1 * y1 ) + asin( y1 )
+			- y0 * sqrt( 1 - y0 * y0 ) - asin( y0 );
+		half[ i ] = area / ( 2 * ( y1 - y0 ) );
+		total += area;
+	}
+
+	return total;
+} /* }}} */
+
+static void
+scatter_rows_blur( void *arg, unsigned long int job ) /* {{{ */
+{
+	scatter_job_t *sj = arg;
+	unsigned long int x, y, y_stop, width = sj->tt->box.width;
+	double bound[ SAT_DISC_STRIPS + 1 ], half[ SAT_DISC_STRIPS ], area;
+	unsigned int i;
+
+	area = sat_disc_strips( bound, half );
+
+	y_stop = ( job + 1 ) * ROWS_PER_JOB;
+	if ( y_stop > sj->tt->box.height )
+		y_stop = sj->tt->box.height;
+
+	for ( y = job * ROWS_PER_JOB; y < y_stop; y++ )
+	{
+		pixel_rgba_t *row = (pixel_rgba_t *) sj->img_out->row_pointers[ y ];
+		const pixel_partial_t *above = scatter_sat_row( sj, y );
+		const pixel_partial_t *below = scatter_sat_row( sj, y + 1 );
+		const float *blur = sj->tt->blur + y * width;
+
+		for ( x = 0; x < width; x++ )
+		{
+			pixel_partial_t p;
+			double r = blur[ x ];
+
+			if ( r < 0.5 )
+			{
+				/* the pixel itself */
+				p.r = below[ x + 1 ].r - below[ x ].r - above[ x + 1 ].r + above[ x ].r;
+				p.g = below[ x + 1 ].g - below[ x ].g - above[ x + 1 ].g + above[ x ].g;
+				p.b = below[ x + 1 ].b - below[ x ].b - above[ x + 1 ].b + above[ x ].b;
+				p.a = below[ x + 1 ].a - below[ x ].a - above[ x + 1 ].a + above[ x ].a;
+			}
+			else
+			{
+				sat_edge_t edge[ SAT_DISC_STRIPS + 1 ];
+				double fix = 1 / ( area * r * r );
+
+				for ( i = 0; i <= SAT_DISC_STRIPS; i++ )
+					scatter_sat_edge( sj, y + r * bound[ i ], edge + i );
+
+				p.r = p.g = p.b = p.a = 0;
+				for ( i = 0; i < SAT_DISC_STRIPS; i++ )
+				{
+					pixel_partial_t s00, s01, s10, s11;
+					double h = r * half[ i ];
+					scatter_sat_lookup( sj, edge + i, x - h, &s00 );
+					scatter_sat_lookup( sj, edge + i, x + h, &s01 );
+					scatter_sat_lookup( sj, edge + i + 1, x - h, &s10 );
+					scatter_sat_lookup( sj, edge + i + 1, x + h, &s11 );
+					p.r += s11.r - s10.r - s01.r + s00.r;
+					p.g += s11.g - s10.g - s01.g + s00.g;
+					p.b += s11.b - s10.b - s01.b + s00.b;
+					p.a += s11.a - s10.a - s01.a + s00.a;
+				}
+				p.r *= fix;
+				p.g *= fix;
+				p.b *= fix;
+				p.a *= fix;
+			}
+
+			/* differences of large sums, uncovered pixels are only rounding */
+			if ( p.a < 1e-6 )
+				continue;
+			p.r = p.r < 0 ? 0 : p.r > 255 * p.a ? 255 * p.a : p.r;
+			p.g = p.g < 0 ? 0 : p.g > 255 * p.a ? 255 * p.a : p.g;
+			p.b = p.b < 0 ? 0 : p.b > 255 * p.a ? 255 * p.a : p.b;
+			pixel_normalize( &p, row + x );
+		}
+	}
+} /* }}} */
+
+static void
+render_scatter( const transform_table_t *transform_table, workers_t *workers,
+		accum_t accum, const uint32_t *fixed_weights, const splat_funcs_t *splat,
+		image_input_t *input, long int do_width, long int do_height,
+		long int move_x, long int move_y, image_file_t *img_out,
+		image_stats_t *stats ) /* {{{ */
+{
+	scatter_job_t sj;
+	unsigned int b, mark;
+	long int rows;
+	double t = stats ? monotonic_ms() : 0;
+
+	sj.tt = transform_table;
+	sj.accum = accum;
+	sj.fixed_weights = fixed_weights;
+	sj.splat = splat;
+	sj.input = input;
+	sj.do_width = do_width;
+	sj.move_x = move_x;
+	sj.img_out = img_out;
+	sj.sat = NULL;
+	sj.bands_count = workers ? workers->count : 1;
+
+	rows = do_height - move_y;
+	if ( rows < 0 )
+		rows = 0;
+	if ( sj.bands_count > rows )
+		sj.bands_count = rows ? rows : 1;
+
+	/* bands read their rows concurrently */
+	if ( sj.bands_count > 1 )
+	{
+		image_input_load( input );
+		stats_lap( stats, PHASE_DECODE, &t );
+	}
+
+	sj.bands = calloc( sizeof( scatter_band_t ), sj.bands_count );
+	if ( !sj.bands )
+		die( "Cannot allocate band memory" );
+	mark = die_hold( &sj, scatter_job_release );
+	for ( b = 0; b < sj.bands_count; b++ )
+	{
+		sj.bands[ b ].y_start = move_y + rows * b / sj.bands_count;
+		sj.bands[ b ].y_stop = move_y + rows * ( b + 1 ) / sj.bands_count;
+	}
+
+	workers_run( workers, scatter_band_splat, &sj, sj.bands_count );
+	stats_lap( stats, PHASE_SPLAT, &t );
+	if ( transform_table->blur )
+	{
+		size_t sat_size = sizeof( pixel_partial_t )
+			* ( transform_table->box.width + 1 ) * ( transform_table->box.height + 1 );
+		sj.sat = malloc( sat_size );
+		if ( !sj.sat )
+			die( "Cannot allocate summed-area table memory" );
+		memset( sj.sat, 0, sizeof( pixel_partial_t ) * ( transform_table->box.width + 1 ) );
+		workers_run( workers, scatter_rows_sat, &sj,
+				( transform_table->box.height + ROWS_PER_JOB - 1 ) / ROWS_PER_JOB );
+		workers_run( workers, scatter_columns_sat, &sj,
+				( transform_table->box.width + SAT_COLUMNS_PER_JOB ) / SAT_COLUMNS_PER_JOB );
+		workers_run( workers, scatter_rows_blur, &sj,
+				( transform_table->box.height + ROWS_PER_JOB - 1 ) / ROWS_PER_JOB );
+		free( sj.sat );
+		sj.sat = NULL;
+		if ( stats )
+			stats->accum_bytes += sat_size;
+	}
+	else
+	{
+		workers_run( workers, scatter_rows_normalize, &sj,
+				( transform_table->box.height + ROWS_PER_JOB - 1 ) / ROWS_PER_JOB );
+	}
+	stats_lap( stats, PHASE_NORMALIZE, &t );
+	if ( stats )
+		scatter_bands_stats( sj.bands, sj.bands_count, accum,
+				transform_table->box.width, stats );
+
+	die_unhold( mark );
+	scatter_job_release( &sj );
+} /* }}} */
+
+/*
+ * Single threaded scatter rendering straight to a png file. The accumulator
+ * is a ring of window_rows rows; once all patch rows able to reach an output
+ * row are splatted, it is normalized, written and its slot cleared for reuse.
+ */
+static void
+render_scatter_stream( const transform_table_t *transform_table,
+		accum_t accum, const uint32_t *fixed_weights, const splat_funcs_t *splat,
+		image_input_t *input, long int do_width, long int do_height,
+		long int move_x, long int move_y, const char *out_file,
+		const output_opts_t *oo, image_stats_t *stats ) /* {{{ */
+{
+	double t = stats ? monotonic_ms() : 0;
+	scatter_job_t sj;
+	scatter_band_t band;
+	image_output_t *out;
+	pixel_rgba_t *row;
+	unsigned long int x, width = transform_table->box.width;
+	unsigned long int next = 0;
+	size_t row_size = accum_size[ accum ] * width;
+	unsigned int mark;
+	long int y;
+
+	memset( &sj, 0, sizeof( sj ) );
+	sj.tt = transform_table;
+	sj.accum = accum;
+	sj.fixed_weights = fixed_weights;
+	sj.splat = splat;
+	sj.input = input;
+	sj.do_width = do_width;
+	sj.move_x = move_x;
+	sj.bands = &band;
+	sj.bands_count = 1;
+
+	memset( &band, 0, sizeof( band ) );
+	band.out_stop = transform_table->box.height;
+	band.ring_rows = transform_table->window_rows;
+	band.acc = calloc( band.ring_rows, row_size );
+	row = malloc( sizeof( pixel_rgba_t ) * width );
+	mark = die_hold( band.acc, free );
+	die_hold( row, free );
+	if ( !band.acc || !row )
+		die( "Cannot allocate accumulator memory" );
+
+	out = image_output_open( out_file, transform_table->output_width,
+			transform_table->output_height, &transform_table->box, oo );
+	die_hold( out, image_output_release );
+	for ( y = move_y < do_height ? move_y : do_height; y <= do_height; y++ )
+	{
+		unsigned long int done = transform_table->box.height;
+		if ( y < do_height && transform_table->row_out_first[ y ] < done )
+			done = transform_table->row_out_first[ y ];
+
+		/* output rows no remaining patch row reaches */
+		for ( ; next < done; next++ )
+		{
+			char *acc = scatter_band_row( &band, row_size, next );
+			memset( row, 0, sizeof( pixel_rgba_t ) * width );
+			for ( x = 0; x < width; x++ )
+			{
+				pixel_partial_t p;
+				accum_get( accum, acc, x, &p );
+				pixel_normalize( &p, row + x );
+			}
+			memset( acc, 0, row_size );
+			stats_lap( stats, PHASE_NORMALIZE, &t );
+			image_output_row( out, (png_byte *) row );
+			stats_lap( stats, PHASE_ENCODE, &t );
+		}
+
+		if ( y < do_height )
+		{
+			/* decoded here only to tell decoding and splatting apart */
+			if ( stats )
+			{
+				image_input_row( input, y );
+				stats_lap( stats, PHASE_DECODE, &t );
+			}
+			scatter_band_rows( &sj, &band, y, y + 1 );
+			stats_lap( stats, PHASE_SPLAT, &t );
+		}
+	}
+	image_output_close( &out );
+	die_unhold( mark );
+	stats_lap( stats, PHASE_ENCODE, &t );
+	if ( stats )
+		scatter_bands_stats( &band, 1, accum, width, stats );
+
+	free( row );
+	free( band.acc );
+} /* }}} */
+
+typedef struct gather_job_s
+{
+	const gather_table_t *gt;
+	image_input_t *input;
+	long int do_width;
+	long int do_height;
+	long int move_x;
+	long int move_y;
+	pixel_partial_t *pre;
+	image_file_t *img_out;
+} gather_job_t;
+
+/* premultiplied inputs, pixels which are not rendered stay zero */
+static void
+gather_rows_premultiply( void *arg, unsigned long int job ) /* {{{ */
+{
+	gather_job_t *gj = arg;
+	long int x, y, y_stop;
+
+	y_stop = ( job + 1 ) * ROWS_PER_JOB;
+	if ( y_stop > gj->do_height )
+		y_stop = gj->do_height;
+
+	for ( y = job * ROWS_PER_JOB; y < y_stop; y++ )
+	{
+		const pixel_rgba_t *in_row;
+		pixel_partial_t *pre_row = gj->pre + y * gj->gt->patch_width;
+		if ( y < gj->move_y )
+			continue;
+		in_row = image_input_row( gj->input, y );
+		for ( x = gj->move_x; x < gj->do_width; x++ )
+		{
+			double alpha = ( double ) in_row[ x ].a / 255.0 * gj->gt->alpha_fix;
+			pre_row[ x ].r = alpha * in_row[ x ].r;
+			pre_row[ x ].g = alpha * in_row[ x ].g;
+			pre_row[ x ].b = alpha * in_row[ x ].b;
+			pre_row[ x ].a = alpha;
+		}
+	}
+} /* }}} */
+
+static void
+gather_rows_render( void *arg, unsigned long int job ) /* {{{ */
+{
+	gather_job_t *gj = arg;
+	const gather_table_t *gt = gj->gt;
+	unsigned long int x, y, y_stop;
+
+	y_stop = ( job + 1 ) * ROWS_PER_JOB;
+	if ( y_stop > gt->box_height )
+		y_stop = gt->box_height;
+
+	for ( y = job * ROWS_PER_JOB; y < y_stop; y++ )
+	{
+		pixel_rgba_t *row = (pixel_rgba_t *) gj->img_out->row_pointers[ y ];
+		const uint64_t *start = gt->start + y * gt->box_width;
+		for ( x = 0; x < gt->box_width; x++ )
+		{
+			pixel_partial_t sum = { 0, 0, 0, 0 };
+			uint64_t t;
+			for ( t = start[ x ]; t < start[ x + 1 ]; t++ )
+			{
+				const gather_tap_t *tap = gt->taps + t;
+				const pixel_partial_t *p_in = gj->pre + tap->input;
+				sum.r += tap->weight * p_in->r;
+				sum.g += tap->weight * p_in->g;
+				sum.b += tap->weight * p_in->b;
+				sum.a += tap->weight * p_in->a;
+			}
+			pixel_normalize( &sum, row + x );
+		}
+	}
+} /* }}} */
+
+static void
+render_gather( const gather_table_t *gt, workers_t *workers,
+		image_input_t *input, long int do_width, long int do_height,
+		long int move_x, long int move_y, image_file_t *img_out,
+		image_stats_t *stats ) /* {{{ */
+{
+	gather_job_t gj = { gt, input, do_width, do_height, move_x, move_y, NULL, img_out };
+	unsigned long int job;
+	unsigned int mark;
+	double t = stats ? monotonic_ms() : 0;
+
+	gj.pre = calloc( sizeof( pixel_partial_t ), gt->patch_width * gt->patch_height );
+	if ( !gj.pre )
+		die( "Cannot allocate input memory" );
+	mark = die_hold( gj.pre, free );
+
+	/* premultiplying is cheap, streamed rows are taken in order */
+	if ( image_input_streaming( input ) )
+	{
+		for ( job = 0; job * ROWS_PER_JOB < do_height; job++ )
+			gather_rows_premultiply( &gj, job );
+	}
+	else if ( do_height > 0 )
+	{
+		workers_run( workers, gather_rows_premultiply, &gj,
+				( do_height + ROWS_PER_JOB - 1 ) / ROWS_PER_JOB );
+	}
+	/* premultiplying counts as decoding, gathering as splatting */
+	stats_lap( stats, PHASE_DECODE, &t );
+	workers_run( workers, gather_rows_render, &gj,
+			( gt->box_height + ROWS_PER_JOB - 1 ) / ROWS_PER_JOB );
+	stats_lap( stats, PHASE_SPLAT, &t );
+	if ( stats )
+	{
+		stats->taps += gt->start[ gt->box_width * gt->box_height ];
+		stats->accum_bytes += sizeof( pixel_partial_t ) * gt->patch_width * gt->patch_height;
+	}
+
+	die_unhold( mark );
+	free( gj.pre );
+} /* }}} */
+
+/* one input -> output conversion, split into decode, render and encode */
+typedef struct image_job_s
+{
+	const char *in_file;
+	const char *out_file;
+	long int move_x;
+	long int move_y;
+	image_input_t *input;
+	image_file_t *img_out;
+	/* filled in if render_opts_t stats is set */
+	image_stats_t stats;
+} image_job_t;
+
+static void
+image_job_decode( const render_opts_t *opts, image_job_t *job, bool load ) /* {{{ */
+{
+	double t = opts->stats ? monotonic_ms() : 0;
+	image_stats_t *stats = opts->stats ? &job->stats : NULL;
+
+	printf( "Image process %s -> %s with +%ld+%ld\n",
+			job->in_file, job->out_file,
+			job->move_x, job->move_y
+		);
+
+	job->input = image_input_open( job->in_file );
+	if ( load )
+		image_input_load( job->input );
+	stats_lap( stats, PHASE_DECODE, &t );
+} /* }}} */
+
+/* input area covered by the table */
+static void
+image_job_extent( const transform_table_t *transform_table, const image_job_t *job,
+		long int *do_width, long int *do_height ) /* {{{ */
+{
+	*do_width = transform_table->patch_width;
+	if ( job->input->width < *do_width )
+		*do_width = job->input->width;
+	*do_height = transform_table->patch_height;
+	if ( job->input->height < *do_height )
+		*do_height = job->input->height;
+} /* }}} */
+
+static void
+image_job_render( const transform_table_t *transform_table, const render_opts_t *opts,
+		image_job_t *job ) /* {{{ */
+{
+	image_input_t *input = job->input;
+	long int do_width, do_height;
+
+	image_job_extent( transform_table, job, &do_width, &do_height );
+
+	image_file_t *img_out;
+	unsigned int mark;
+	img_out = image_new( transform_table->box.width, transform_table->box.height );
+	mark = die_hold( &img_out, image_release );
+
+	if ( opts->engine == ENGINE_GATHER )
+		render_gather( opts->gather, opts->workers, input, do_width, do_height,
+				job->move_x, job->move_y, img_out,
+				opts->stats ? &job->stats : NULL );
+	else
+		render_scatter( transform_table, opts->workers,
+				opts->accum, opts->fixed_weights, opts->splat,
+				input, do_width, do_height,
+				job->move_x, job->move_y, img_out,
+				opts->stats ? &job->stats : NULL );
+
+	image_input_close( &job->input );
+	die_unhold( mark );
+	job->img_out = img_out;
+} /* }}} */
+
+/* render and encode in one go, the output image is never held in memory */
+static void
+image_job_render_stream( const transform_table_t *transform_table,
+		const render_opts_t *opts, image_job_t *job ) /* {{{ */
+{
+	long int do_width, do_height;
+
+	image_job_extent( transform_table, job, &do_width, &do_height );
+
+	render_scatter_stream( transform_table,
+			opts->accum, opts->fixed_weights, opts->splat,
+			job->input, do_width, do_height,
+			job->move_x, job->move_y, job->out_file, &opts->output,
+			opts->stats ? &job->stats : NULL );
+
+	image_input_close( &job->input );
+} /* }}} */
+
+static void
+image_job_encode( const transform_table_t *transform_table, const render_opts_t *opts,
+		image_job_t *job ) /* {{{ */
+{
+	double t = opts->stats ? monotonic_ms() : 0;
+
+	image_write_box( job->img_out, job->out_file, transform_table->output_width,
+			transform_table->output_height, &transform_table->box, &opts->output );
+	image_destroy( &job->img_out );
+	stats_lap( opts->stats ? &job->stats : NULL, PHASE_ENCODE, &t );
+} /* }}} */
+
+/* one JSON line per image, written at once as pipeline encoders share it */
+static void
+image_job_report( const transform_table_t *transform_table,
+		const render_opts_t *opts, image_job_t *job ) /* {{{ */
+{
+	const image_stats_t *st = &job->stats;
+	FILE *fp = opts->stats;
+	int i;
+
+	if ( !fp )
+		return;
+
+	flockfile( fp );
+	fputs( "{\"input\":", fp );
+	json_string( fp, job->in_file );
+	fputs( ",\"output\":", fp );
+	json_string( fp, job->out_file );
+	fprintf( fp, ",\"engine\":\"%s\"", engine_names[ opts->engine ] );
+	for ( i = PHASE_DECODE; i < PHASE_COUNT; i++ )
+		fprintf( fp, ",\"%s_ms\":%.3f", phase_names[ i ], st->ms[ i ] );
+	fprintf( fp, ",\"taps\":%llu,\"skipped_transparent\":%llu,"
+			"\"table_bytes\":%zu,\"accum_bytes\":%zu}\n",
+			(unsigned long long) st->taps, (unsigned long long) st->skipped,
+			transform_table_bytes( transform_table ), st->accum_bytes );
+	fflush( fp );
+	funlockfile( fp );
+} /* }}} */
+
+static void
+image_process( const transform_table_t *transform_table, const render_opts_t *opts,
+		const char *in_file, const char *out_file,
+		long int move_x, long int move_y ) /* {{{ */
+{
+	image_job_t job = { in_file, out_file, move_x, move_y, NULL, NULL };
+	unsigned int mark = die_hold( &job.input, image_input_release );
+
+	die_hold( &job.img_out, image_release );
+	/* rows are decoded while rendering, not loaded up front */
+	image_job_decode( opts, &job, false );
+	if ( opts->engine == ENGINE_SCATTER && !opts->workers )
+	{
+		/* single threaded scatter also encodes rows as soon as they are final */
+		image_job_render_stream( transform_table, opts, &job );
+	}
+	else
+	{
+		image_job_render( transform_table, opts, &job );
+		image_job_encode( transform_table, opts, &job );
+	}
+	die_unhold( mark );
+	image_job_report( transform_table, opts, &job );
+} /* }}} */
+
+/*
+ * Batch pipeline: decode, render and encode run in their own threads,
+ * connected by bounded queues, so libpng work of one image overlaps the
+ * rendering of another. Queue depth bounds the number of decoded and
+ * rendered images waiting in memory.
+ */
+typedef struct job_queue_s
+{
+	image_job_t **jobs;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	bool closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} job_queue_t;
+
+static void
+job_queue_init( job_queue_t *q, unsigned int size ) /* {{{ */
+{
+	q->jobs = malloc( sizeof( image_job_t * ) * size );
+	if ( !q->jobs )
+		die( "Cannot allocate queue memory" );
+	q->size = size;
+	q->head = 0;
+	q->count = 0;
+	q->closed = false;
+	pthread_mutex_init( &q->lock, NULL );
+	pthread_cond_init( &q->not_empty, NULL );
+	pthread_cond_init( &q->not_full, NULL );
+} /* }}} */
+
+static void
+job_queue_push( job_queue_t *q, image_job_t *job ) /* {{{ */
+{
+	pthread_mutex_lock( &q->lock );
+	while ( q->count == q->size )
+		pthread_cond_wait( &q->not_full, &q->lock );
+	q->jobs[ ( q->head + q->count++ ) % q->size ] = job;
+	pthread_cond_signal( &q->not_empty );
+	pthread_mutex_unlock( &q->lock );
+} /* }}} */
+
+/* returns NULL once the queue is closed and empty */
+static image_job_t *
+job_queue_pop( job_queue_t *q ) /* {{{ */
+{
+	image_job_t *job = NULL;
+
+	pthread_mutex_lock( &q->lock );
+	while ( !q->count && !q->closed )
+		pthread_cond_wait( &q->not_empty, &q->lock );
+	if ( q->count )
+	{
+		job = q->jobs[ q->head ];
+		q->head = ( q->head + 1 ) % q->size;
+		q->count--;
+		pthread_cond_signal( &q->not_full );
+	}
+	pthread_mutex_unlock( &q->lock );
+
+	return job;
+} /* }}} */
+
+static void
+job_queue_close( job_queue_t *q ) /* {{{ */
+{
+	pthread_mutex_lock( &q->lock );
+	q->closed = true;
+	pthread_cond_broadcast( &q->not_empty );
+	pthread_mutex_unlock( &q->lock );
+} /* }}} */
+
+static void
+job_queue_destroy( job_queue_t *q ) /* {{{ */
+{
+	pthread_mutex_destroy( &q->lock );
+	pthread_cond_destroy( &q->not_empty );
+	pthread_cond_destroy( &q->not_full );
+	free( q->jobs );
+} /* }}} */
+
+#define PIPELINE_DECODE 0
+#define PIPELINE_RENDER 1
+#define PIPELINE_ENCODE 2
+#define PIPELINE_STAGES 3
+
+typedef struct pipeline_config_s
+{
+	unsigned int depth;
+	unsigned int threads[ PIPELINE_STAGES ];
+} pipeline_config_t;
+
+struct pipeline_s;
+
+typedef struct pipeline_stage_s
+{
+	struct pipeline_s *pipeline;
+	int stage;
+	unsigned int count;
+	/* the last thread leaving a stage closes the next queue */
+	unsigned int running;
+	pthread_t *threads;
+} pipeline_stage_t;
+
+typedef struct pipeline_s
+{
+	const transform_table_t *tt;
+	const render_opts_t *opts;
+	/* queue[ i ] feeds stage i */
+	job_queue_t queue[ PIPELINE_STAGES ];
+	pipeline_stage_t stages[ PIPELINE_STAGES ];
+	pthread_mutex_t lock;
+} pipeline_t;
+
+static void *
+pipeline_thread( void *arg ) /* {{{ */
+{
+	pipeline_stage_t *stage = arg;
+	pipeline_t *p = stage->pipeline;
+	image_job_t *job;
+
+	while ( ( job = job_queue_pop( p->queue + stage->stage ) ) )
+	{
+		switch ( stage->stage )
+		{
+			case PIPELINE_DECODE:
+				/* decoders run ahead of renderers, so they decode everything */
+				image_job_decode( p->opts, job, true );
+				break;
+			case PIPELINE_RENDER:
+				image_job_render( p->tt, p->opts, job );
+				break;
+			case PIPELINE_ENCODE:
+				image_job_encode( p->tt, p->opts, job );
+				image_job_report( p->tt, p->opts, job );
+				free( job );
+				continue;
+		}
+		job_queue_push( p->queue + stage->stage + 1, job );
+	}
+
+	pthread_mutex_lock( &p->lock );
+	if ( !--stage->running && stage->stage + 1 < PIPELINE_STAGES )
+		job_queue_close( p->queue + stage->stage + 1 );
+	pthread_mutex_unlock( &p->lock );
+
+	return NULL;
+} /* }}} */
+
+static pipeline_t *
+pipeline_new( const transform_table_t *tt, const render_opts_t *opts,
+		const pipeline_config_t *config ) /* {{{ */
+{
+	pipeline_t *p;
+	unsigned int i;
+	int s;
+
+	p = malloc( sizeof( pipeline_t ) );
+	if ( !p )
+		die( "Cannot allocate pipeline memory" );
+	p->tt = tt;
+	p->opts = opts;
+	pthread_mutex_init( &p->lock, NULL );
+
+	for ( s = 0; s < PIPELINE_STAGES; s++ )
+		job_queue_init( p->queue + s, config->depth );
+
+	for ( s = 0; s < PIPELINE_STAGES; s++ )
+	{
+		pipeline_stage_t *stage = p->stages + s;
+		stage->pipeline = p;
+		stage->stage = s;
+		stage->count = stage->running = config->threads[ s ];
+		stage->threads = malloc( sizeof( pthread_t ) * stage->count );
+		if ( !stage->threads )
+			die( "Cannot allocate pipeline memory" );
+		for ( i = 0; i < config->threads[ s ]; i++ )
+		{
+			if ( pthread_create( stage->threads + i, NULL, pipeline_thread, stage ) )
+				die( "Cannot start pipeline thread" );
+		}
+	}
+
+	return p;
+} /* }}} */
+
+static void
+pipeline_push( pipeline_t *p, const char *in_file, const char *out_file,
+		long int move_x, long int move_y ) /* {{{ */
+{
+	image_job_t *job = calloc( 1, sizeof( image_job_t ) );
+	if ( !job )
+		die( "Cannot allocate job memory" );
+
+	job->in_file = in_file;
+	job->out_file = out_file;
+	job->move_x = move_x;
+	job->move_y = move_y;
+	job->input = NULL;
+	job->img_out = NULL;
+
+	job_queue_push( p->queue + PIPELINE_DECODE, job );
+} /* }}} */
+
+/* waits for all pushed jobs */
+static void
+pipeline_finish( pipeline_t **pp ) /* {{{ */
+{
+	pipeline_t *p = *pp;
+	unsigned int i;
+	int s;
+
+	job_queue_close( p->queue + PIPELINE_DECODE );
+	for ( s = 0; s < PIPELINE_STAGES; s++ )
+	{
+		pipeline_stage_t *stage = p->stages + s;
+		for ( i = 0; i < stage->count; i++ )
+			pthread_join( stage->threads[ i ], NULL );
+		free( stage->threads );
+	}
+
+	for ( s = 0; s < PIPELINE_STAGES; s++ )
+		job_queue_destroy( p->queue + s );
+	pthread_mutex_destroy( &p->lock );
+	free( p );
+	*pp = NULL;
+} /* }}} */
+
+/* reads the 24 numbers, returns the index of an invalid one or -1 */
+static int
+parse_table_params( char **args, table_params_t *params ) /* {{{ */
+{
+	double tmp = 0;
+	coord_t *data = params->list;
+	int i;
+
+	for ( i = 0; i < 24; i++ )
+	{
+		char *arg = args[ i ];
+		char *tail = NULL;
+		char *end = arg + strlen( arg );
+		double out;
+		out = strtod( arg, &tail );
+		if ( tail != end || tail == arg )
+			return i;
+		if ( i % 2 )
+		{
+			data[ i / 2 ].x = tmp;
+			data[ i / 2 ].y = out;
+		}
+		else
+		{
+			tmp = out;
+		}
+	}
+
+	return -1;
+} /* }}} */
+
+/* "+X+Y" */
+static bool
+parse_position( const char *arg, long int *move_x, long int *move_y ) /* {{{ */
+{
+	char *tail = NULL, *tail2 = NULL;
+	const char *end = arg + strlen( arg );
+
+	*move_x = strtol( arg, &tail, 10 );
+	if ( !tail || tail == arg )
+		return false;
+	*move_y = strtol( tail, &tail2, 10 );
+	if ( !tail2 || tail2 == tail || tail2 != end )
+		return false;
+	return true;
+} /* }}} */
+
+/* decimal number in min .. max, no sign, nothing after it */
+static bool
+parse_count( const char *arg, unsigned long int min, unsigned long int max,
+		unsigned long int *out ) /* {{{ */
+{
+	char *tail = NULL;
+
+	if ( !isdigit( (unsigned char) arg[0] ) )
+		return false;
+	errno = 0;
+	*out = strtoul( arg, &tail, 10 );
+	if ( errno || *tail || *out < min || *out > max )
+		return false;
+	return true;
+} /* }}} */
+
+/* table from the cache directory, built (and stored there) if missing */
+static transform_table_t *
+transform_table_obtain( const table_params_t *params, const char *cache_dir,
+		geometry_cache_t *geometry, workers_t *workers, FILE *stats ) /* {{{ */
+{
+	transform_table_t *transform_table = NULL;
+	char *table_path = NULL;
+	const char *grid_source = "none";
+	double start = stats ? monotonic_ms() : 0;
+	bool built = false;
+	unsigned int mark = die_holds_count;
+
+	if ( cache_dir )
+	{
+		table_path = transform_table_path( cache_dir, params );
+		mark = die_hold( table_path, free );
+		transform_table = transform_table_from_file( table_path, params );
+	}
+	if ( !transform_table )
+	{
+		const point_grid_t *grid;
+		grid = geometry_cache_grid( geometry, params, cache_dir, workers, &grid_source );
+		transform_table = calc_transform_table( params, grid, workers );
+		if ( table_path )
+			transform_table_write( transform_table, table_path, params );
+		built = true;
+	}
+	die_unhold( mark );
+	free( table_path );
+
+	if ( stats )
+	{
+		fprintf( stats, "{\"table\":\"%016llx\",\"source\":\"%s\",\"grid\":\"%s\","
+				"\"table_ms\":%.3f,\"table_bytes\":%zu,\"box\":[%lu,%lu,%lu,%lu],"
+				"\"offcanvas\":%lu,\"clipped_kernels\":%lu}\n",
+				(unsigned long long) transform_table_key( params ),
+				built ? "built" : "file", grid_source, monotonic_ms() - start,
+				transform_table_bytes( transform_table ),
+				transform_table->box.x, transform_table->box.y,
+				transform_table->box.width, transform_table->box.height,
+				transform_table->circles_dropped, transform_table->circles_clipped );
+		fflush( stats );
+	}
+
+	return transform_table;
+} /* }}} */
+
+/* derives the per table data the render options ask for */
+static void
+render_opts_bind( render_opts_t *opts, const transform_table_t *tt ) /* {{{ */
+{
+	if ( opts->engine == ENGINE_GATHER )
+		opts->gather = calc_gather_table( tt );
+	else if ( opts->accum == ACCUM_FIXED )
+		opts->fixed_weights = calc_fixed_weights( tt );
+} /* }}} */
+
+static void
+render_opts_release( render_opts_t *opts ) /* {{{ */
+{
+	if ( opts->gather )
+		destroy_gather_table( &opts->gather );
+	free( opts->fixed_weights );
+	opts->fixed_weights = NULL;
+} /* }}} */
+
+/*
+ * Resident tables of several templates, most recently used first. Tables
+ * are evicted from the tail once they hold more than budget bytes together
+ * with their render data, but the one just asked for always stays.
+ */
+typedef struct table_cache_entry_s
+{
+	struct table_cache_entry_s *next;
+	table_params_t params;
+	uint64_t key;
+	transform_table_t *tt;
+	/* render_opts_bind() output for this table */
+	gather_table_t *gather;
+	uint32_t *fixed_weights;
+	size_t bytes;
+} table_cache_entry_t;
+
+typedef struct table_cache_s
+{
+	const char *cache_dir;
+	size_t budget;
+	size_t bytes;
+	table_cache_entry_t *head;
+	/* for the next table built, not counted in bytes */
+	geometry_cache_t geometry;
+} table_cache_t;
+
+static void
+table_cache_entry_destroy( table_cache_entry_t **e ) /* {{{ */
+{
+	destroy_transform_table( &(*e)->tt );
+	if ( (*e)->gather )
+		destroy_gather_table( &(*e)->gather );
+	free( (*e)->fixed_weights );
+	free( *e );
+	*e = NULL;
+} /* }}} */
+
+/* die_hold() release of an entry still being filled in */
+static void
+table_cache_entry_release( void *object ) /* {{{ */
+{
+	table_cache_entry_t *e = object;
+
+	if ( e->tt )
+		table_cache_entry_destroy( &e );
+	else
+		free( e );
+} /* }}} */
+
+/* the table for params, with the render data opts asks for */
+static table_cache_entry_t *
+table_cache_get( table_cache_t *cache, const table_params_t *params,
+		const render_opts_t *opts ) /* {{{ */
+{
+	uint64_t key = transform_table_key( params );
+	table_cache_entry_t **pe, *e;
+	render_opts_t bound = *opts;
+	unsigned int mark;
+
+	for ( pe = &cache->head; *pe; pe = &(*pe)->next )
+	{
+		e = *pe;
+		if ( e->key != key || memcmp( &e->params, params, sizeof( *params ) ) )
+			continue;
+		/* move to front */
+		*pe = e->next;
+		e->next = cache->head;
+		cache->head = e;
+		return e;
+	}
+
+	e = calloc( 1, sizeof( table_cache_entry_t ) );
+	if ( !e )
+		die( "Cannot allocate table cache memory" );
+	mark = die_hold( e, table_cache_entry_release );
+	e->params = *params;
+	e->key = key;
+	e->tt = transform_table_obtain( params, cache->cache_dir, &cache->geometry,
+			opts->workers, opts->stats );
+
+	bound.gather = NULL;
+	bound.fixed_weights = NULL;
+	render_opts_bind( &bound, e->tt );
+	e->gather = bound.gather;
+	e->fixed_weights = bound.fixed_weights;
+
+	e->bytes = transform_table_bytes( e->tt );
+	if ( e->gather )
+		e->bytes += gather_table_bytes( e->gather );
+	if ( e->fixed_weights )
+		e->bytes += sizeof( uint32_t ) * e->tt->weights_count;
+
+	die_unhold( mark );
+	e->next = cache->head;
+	cache->head = e;
+	cache->bytes += e->bytes;
+
+	/* evict least recently used tables, never the new one */
+	while ( cache->bytes > cache->budget && e->next )
+	{
+		table_cache_entry_t *last;
+		for ( pe = &e->next; (*pe)->next; pe = &(*pe)->next )
+			;
+		last = *pe;
+		*pe = NULL;
+		cache->bytes -= last->bytes;
+		table_cache_entry_destroy( &last );
+	}
+
+	return e;
+} /* }}} */
+
+static void
+table_cache_clear( table_cache_t *cache ) /* {{{ */
+{
+	while ( cache->head )
+	{
+		table_cache_entry_t *e = cache->head;
+		cache->head = e->next;
+		table_cache_entry_destroy( &e );
+	}
+	cache->bytes = 0;
+	geometry_cache_clear( &cache->geometry );
+} /* }}} */
+
+/*
+ * Daemon mode. Every line is a job "N1 .. N24 [+X+Y] INPUT OUTPUT" and is
+ * answered with "ok INPUT OUTPUT table T ms render R ms" or "error MESSAGE".
+ * Tables stay resident in a table_cache_t, so jobs of a known template only
+ * pay for rendering.
+ */
+typedef struct daemon_s
+{
+	/* -q settings, the numbers come from the jobs */
+	table_params_t params;
+	const render_opts_t *opts;
+	table_cache_t tables;
+} daemon_t;
+
+#define DAEMON_MAX_TOKENS 28
+
+static void
+daemon_job( daemon_t *d, char *line, FILE *out ) /* {{{ */
+{
+	char *tok[ DAEMON_MAX_TOKENS ], *save = NULL, *p;
+	table_params_t params = d->params;
+	long int move_x = 0, move_y = 0;
+	const char *in_file, *out_file;
+	table_cache_entry_t *entry;
+	render_opts_t opts;
+	double t_start, t_table, t_done;
+	const char *bad_geometry;
+	jmp_buf jump;
+	int n = 0, bad;
+
+	for ( p = strtok_r( line, " \t\r\n", &save ); p; p = strtok_r( NULL, " \t\r\n", &save ) )
+	{
+		if ( n == DAEMON_MAX_TOKENS )
+		{
+			fprintf( out, "error too many fields\n" );
+			return;
+		}
+		tok[ n++ ] = p;
+	}
+	/* empty lines and comments */
+	if ( !n || tok[0][0] == '#' )
+		return;
+
+	if ( n != 26 && n != 27 )
+	{
+		fprintf( out, "error expected 24 numbers, [+X+Y], input and output\n" );
+		return;
+	}
+	bad = parse_table_params( tok, &params );
+	if ( bad >= 0 )
+	{
+		fprintf( out, "error invalid number '%s' in field %d\n", tok[ bad ], bad );
+		return;
+	}
+	if ( n == 27 && !parse_position( tok[ 24 ], &move_x, &move_y ) )
+	{
+		fprintf( out, "error invalid position '%s'\n", tok[ 24 ] );
+		return;
+	}
+	in_file = tok[ n - 2 ];
+	out_file = tok[ n - 1 ];
+	if ( access( in_file, R_OK ) )
+	{
+		fprintf( out, "error cannot read '%s'\n", in_file );
+		return;
+	}
+	bad_geometry = table_params_check( &params );
+	if ( bad_geometry )
+	{
+		fprintf( out, "error %s\n", bad_geometry );
+		return;
+	}
+
+	/* anything dying from here on fails just this job */
+	die_jump = &jump;
+	if ( setjmp( jump ) )
+	{
+		die_jump = NULL;
+		fprintf( out, "error %s\n", die_message );
+		return;
+	}
+	t_start = monotonic_ms();
+	entry = table_cache_get( &d->tables, &params, d->opts );
+	opts = *d->opts;
+	opts.gather = entry->gather;
+	opts.fixed_weights = entry->fixed_weights;
+	t_table = monotonic_ms();
+
+	image_process( entry->tt, &opts, in_file, out_file, move_x, move_y );
+	t_done = monotonic_ms();
+	die_jump = NULL;
+
+	fprintf( out, "ok %s %s table %.1f ms render %.1f ms\n",
+			in_file, out_file, t_table - t_start, t_done - t_table );
+} /* }}} */
+
+static void
+daemon_serve( daemon_t *d, FILE *in, FILE *out ) /* {{{ */
+{
+	char *line = NULL;
+	size_t size = 0;
+
+	while ( getline( &line, &size, in ) >= 0 )
+	{
+		daemon_job( d, line, out );
+		fflush( out );
+	}
+	free( line );
+} /* }}} */
+
+/* "-" serves stdin until EOF, anything else is a socket path served forever */
+static void
+daemon_run( daemon_t *d, const char *path ) /* {{{ */
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int sock;
+
+	if ( !strcmp( path, "-" ) )
+	{
+		/* status lines own stdout, progress messages go to stderr */
+		FILE *status = fdopen( dup( STDOUT_FILENO ), "w" );
+		if ( !status )
+			die( "Cannot duplicate stdout" );
+		fflush( stdout );
+		dup2( STDERR_FILENO, STDOUT_FILENO );
+		daemon_serve( d, stdin, status );
+		fclose( status );
+		return;
+	}
+
+	memset( &addr, 0, sizeof( addr ) );
+	addr.sun_family = AF_UNIX;
+	if ( strlen( path ) >= sizeof( addr.sun_path ) )
+		die( "Socket path '%s' is too long", path );
+	strcpy( addr.sun_path, path );
+
+	sock = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if ( sock < 0 )
+		die( "Cannot create socket" );
+	/* a stale socket from an earlier daemon is replaced, nothing else is */
+	if ( !lstat( path, &st ) )
+	{
+		if ( !S_ISSOCK( st.st_mode ) )
+			die( "'%s' exists and is not a socket", path );
+		unlink( path );
+	}
+	if ( bind( sock, (struct sockaddr *) &addr, sizeof( addr ) ) || listen( sock, 16 ) )
+		die( "Cannot listen on '%s'", path );
+
+	/* a client going away must not kill the daemon */
+	signal( SIGPIPE, SIG_IGN );
+
+	/* clients are served one at a time, in order of connection */
+	for ( ;; )
+	{
+		FILE *in, *out;
+		int fd = accept( sock, NULL, NULL ), out_fd;
+		if ( fd < 0 )
+		{
+			/* out of descriptors or memory, wait instead of spinning */
+			if ( errno != EINTR && errno != ECONNABORTED )
+				sleep( 1 );
+			continue;
+		}
+		/* a client that cannot be served is dropped, the daemon goes on */
+		in = fdopen( fd, "r" );
+		if ( !in )
+		{
+			close( fd );
+			continue;
+		}
+		out_fd = dup( fd );
+		out = out_fd < 0 ? NULL : fdopen( out_fd, "w" );
+		if ( !out )
+		{
+			if ( out_fd >= 0 )
+				close( out_fd );
+			fclose( in );
+			continue;
+		}
+		daemon_serve( d, in, out );
+		fclose( in );
+		fclose( out );
+	}
+} /* }}} */
+
+/*
+ * Benchmark mode. Renders synthetic patches with templates shaped like
+ * real .state files, no assets needed, and prints one JSON line per
+ * template, patch size, alpha coverage and repetition. Tables are rebuilt
+ * every repetition so their build time is measured too; peak_rss_kb is the
+ * process peak so far, cases run from small to large.
+ */
+typedef struct bench_template_s
 {
-	coord_t tmp = coord_add( a, b );
-	return coord_scale( &tmp, 0.5 );
-}
+	const char *name;
+	/* background coordinates and bokeh radii are scaled, angles are not */
+	double scale;
+} bench_template_t;
+
+/* a 2000x2000 mug photo with a 945x1063 patch */
+static const double bench_numbers[ 24 ] = {
+	2000, 2000, 945, 1063,
+	600, 500, 650, 1500, 1400, 500, 1350, 1500, 1000, 620, 1000, 1640,
+	0.3, 2.85,
+	900, 900, 1100, 900, 700, 1100,
+};
+
+static const bench_template_t bench_templates[] = {
+	{ "mug", 1.0 },
+	{ "mug-small", 0.5 },
+};
+
+static const double bench_patch_scales[] = { 0.5, 1.0 };
+static const unsigned int bench_coverages[] = { 100, 50, 10 };
+
+#define BENCH_COUNT( a ) ( sizeof( a ) / sizeof( ( a )[0] ) )
+
+/* gradient art, opaque in 16 px blocks covering about coverage percent */
+static image_file_t *
+bench_patch( unsigned long int width, unsigned long int height,
+		unsigned int coverage ) /* {{{ */
+{
+	image_file_t *image = image_new( width, height );
+	unsigned long int x, y;
+
+	for ( y = 0; y < height; y++ )
+	{
+		pixel_rgba_t *row = (pixel_rgba_t *) image->row_pointers[ y ];
+		for ( x = 0; x < width; x++ )
+		{
+			row[ x ].r = x * 255 / width;
+			row[ x ].g = y * 255 / height;
+			row[ x ].b = ( x ^ y ) & 0xff;
+			row[ x ].a = ( ( x / 16 ) * 7 + ( y / 16 ) * 13 ) % 100 < coverage ? 255 : 0;
+		}
+	}
+
+	return image;
+} /* }}} */
+
+static void
+bench_params( const bench_template_t *bt, double patch_scale,
+		const table_params_t *base, table_params_t *params ) /* {{{ */
+{
+	int i;
+
+	*params = *base;
+	for ( i = 0; i < 12; i++ )
+	{
+		double x = bench_numbers[ 2 * i ], y = bench_numbers[ 2 * i + 1 ];
+		double f = i == POINT_PATCH_SIZE ? patch_scale : bt->scale;
+		if ( i == POINT_ANGLES )
+			f = 1;
+		x *= f;
+		y *= f;
+		/* sizes and points are whole pixels in .state files */
+		if ( i != POINT_ANGLES && i != POINT_FOCUS_R )
+		{
+			x = floor( x + 0.5 );
+			y = floor( y + 0.5 );
+		}
+		params->list[ i ].x = x;
+		params->list[ i ].y = y;
+	}
+} /* }}} */
+
+static char *
+bench_temp_file( void ) /* {{{ */
+{
+	const char *dir = getenv( "TMPDIR" );
+	char *path;
+	int fd;
+
+	if ( !dir || !*dir )
+		dir = "/tmp";
+	path = malloc( strlen( dir ) + sizeof( "/bender-bench-XXXXXX" ) );
+	if ( !path )
+		die( "Cannot allocate path memory" );
+	sprintf( path, "%s/bender-bench-XXXXXX", dir );
+	fd = mkstemp( path );
+	if ( fd < 0 )
+		die( "Cannot create temporary file in '%s'", dir );
+	close( fd );
+
+	return path;
+} /* }}} */
+
+static void
+bench_run( const table_params_t *base, const render_opts_t *opts,
+		unsigned int reps ) /* {{{ */
+{
+	unsigned int t, p, c, rep;
+	char *in_path[ BENCH_COUNT( bench_coverages ) ];
+	char *out_path = bench_temp_file();
+
+	for ( t = 0; t < BENCH_COUNT( bench_templates ); t++ )
+	for ( p = 0; p < BENCH_COUNT( bench_patch_scales ); p++ )
+	{
+		const bench_template_t *bt = bench_templates + t;
+		table_params_t params;
+		bench_params( bt, bench_patch_scales[ p ], base, &params );
+
+		for ( c = 0; c < BENCH_COUNT( bench_coverages ); c++ )
+		{
+			image_file_t *patch = bench_patch( params.list[ POINT_PATCH_SIZE ].x,
+					params.list[ POINT_PATCH_SIZE ].y, bench_coverages[ c ] );
+			in_path[ c ] = bench_temp_file();
+			image_write( patch, in_path[ c ], NULL );
+			image_destroy( &patch );
+		}
+
+		for ( rep = 0; rep < reps; rep++ )
+		{
+			render_opts_t ro = *opts;
+			transform_table_t *tt;
+			/* cold builds, nothing reused between repetitions */
+			geometry_cache_t geometry = { NULL, NULL };
+			const char *source;
+			double table_ms, start = monotonic_ms();
+
+			tt = calc_transform_table( &params, geometry_cache_grid( &geometry,
+					&params, NULL, ro.workers, &source ), ro.workers );
+			geometry_cache_clear( &geometry );
+			if ( ro.accum == ACCUM_FIXED )
+				ro.fixed_weights = calc_fixed_weights( tt );
+			table_ms = monotonic_ms() - start;
+
+			for ( c = 0; c < BENCH_COUNT( bench_coverages ); c++ )
+			{
+				image_stats_t st;
+				double *ms = st.ms;
+				double pixels = (double) tt->patch_width * tt->patch_height;
+				image_input_t *input;
+				image_file_t *img_out;
+				struct rusage ru;
+				int i;
+
+				memset( &st, 0, sizeof( st ) );
+				ms[ PHASE_TABLE ] = table_ms;
+
+				start = monotonic_ms();
+				input = image_input_open( in_path[ c ] );
+				image_input_load( input );
+				ms[ PHASE_DECODE ] = monotonic_ms() - start;
+
+				img_out = image_new( tt->box.width, tt->box.height );
+				render_scatter( tt, ro.workers, ro.accum, ro.fixed_weights, ro.splat,
+						input, tt->patch_width, tt->patch_height, 0, 0, img_out, &st );
+				image_input_close( &input );
+
+				start = monotonic_ms();
+				image_write_box( img_out, out_path, tt->output_width, tt->output_height,
+						&tt->box, NULL );
+				ms[ PHASE_ENCODE ] = monotonic_ms() - start;
+				image_destroy( &img_out );
+
+				getrusage( RUSAGE_SELF, &ru );
+				printf( "{\"template\":\"%s\",\"patch\":\"%lux%lu\",\"output\":\"%lux%lu\","
+						"\"coverage\":%u,\"rep\":%u,\"engine\":\"%s\",\"accum\":\"%s\","
+						"\"splat\":\"%s\",\"threads\":%u",
+						bt->name, tt->patch_width, tt->patch_height,
+						tt->output_width, tt->output_height,
+						bench_coverages[ c ], rep, engine_names[ ro.engine ],
+						accum_names[ ro.accum ],
+						ro.splat->name, ro.workers ? ro.workers->count : 1 );
+				for ( i = 0; i < PHASE_COUNT; i++ )
+					printf( ",\"%s_ms\":%.3f", phase_names[ i ], ms[ i ] );
+				printf( ",\"splat_mpix_s\":%.3f,\"mpix_s\":%.3f,\"taps\":%llu,"
+						"\"table_bytes\":%zu,\"accum_bytes\":%zu,\"peak_rss_kb\":%ld}\n",
+						pixels / 1e3 / ms[ PHASE_SPLAT ],
+						pixels / 1e3 / ( ms[ PHASE_DECODE ] + ms[ PHASE_SPLAT ]
+							+ ms[ PHASE_NORMALIZE ] + ms[ PHASE_ENCODE ] ),
+						(unsigned long long) st.taps,
+						transform_table_bytes( tt ), st.accum_bytes, ru.ru_maxrss );
+				fflush( stdout );
+			}
+
+			free( ro.fixed_weights );
+			destroy_transform_table( &tt );
+		}
+
+		for ( c = 0; c < BENCH_COUNT( bench_coverages ); c++ )
+		{
+			unlink( in_path[ c ] );
+			free( in_path[ c ] );
+		}
+	}
+
+	unlink( out_path );
+	free( out_path );
+} /* }}} */
+
+/*
+ * Self-test (-T): synthetic patches go through every engine and option
+ * combination, and the results are held against selftest_reference_render(),
+ * a frozen copy of the first bender's per pixel circles, splat and
+ * normalize that shares no code with the tables and engines, by the largest
+ * error of every premultiplied channel and by PSNR over the pixels covered
+ * in either image. Scaled renders are held against its accumulator box
+ * filtered down before normalizing. Prints JSON lines like -B.
+ */
+typedef struct selftest_case_s
+{
+	const char *name;
+	render_engine_t engine;
+	accum_t accum;
+	/* NULL for the best one, see splat_select() */
+	const char *splat;
+	unsigned int threads;
+	/* table options, see table_params_t */
+	uint32_t radius_steps;
+	uint32_t phase_steps;
+	double scale;
+	/* for ENGINE_SAT, as -t */
+	double sat_tolerance;
+	/* rendered straight to a file, see render_scatter_stream() */
+	bool stream;
+	/* table written to a file and mapped back */
+	bool table_file;
+	/* bounds, 0 for no PSNR bound */
+	double max_error;
+	double min_psnr;
+} selftest_case_t;
+
+static const selftest_case_t selftest_cases[] = {
+	/* name, engine, accum, splat, threads, quantization, scale, -t, stream, file, bounds */
+	{ "double-scalar", ENGINE_SCATTER, ACCUM_DOUBLE, "scalar", 1, 0, 0, 1, 0, false, false, 1, 80 },
+#ifdef HAVE_X86_SIMD
+	{ "double-sse2", ENGINE_SCATTER, ACCUM_DOUBLE, "sse2", 1, 0, 0, 1, 0, false, false, 1, 80 },
+	{ "double-avx2", ENGINE_SCATTER, ACCUM_DOUBLE, "avx2", 1, 0, 0, 1, 0, false, false, 1, 80 },
+	{ "double-avx512", ENGINE_SCATTER, ACCUM_DOUBLE, "avx512", 1, 0, 0, 1, 0, false, false, 1, 80 },
+#endif
+	{ "float-scalar", ENGINE_SCATTER, ACCUM_FLOAT, "scalar", 1, 0, 0, 1, 0, false, false, 1, 75 },
+#ifdef HAVE_X86_SIMD
+	{ "float-sse2", ENGINE_SCATTER, ACCUM_FLOAT, "sse2", 1, 0, 0, 1, 0, false, false, 1, 75 },
+	{ "float-avx2", ENGINE_SCATTER, ACCUM_FLOAT, "avx2", 1, 0, 0, 1, 0, false, false, 1, 75 },
+	{ "float-avx512", ENGINE_SCATTER, ACCUM_FLOAT, "avx512", 1, 0, 0, 1, 0, false, false, 1, 75 },
+#endif
+	{ "fixed-scalar", ENGINE_SCATTER, ACCUM_FIXED, "scalar", 1, 0, 0, 1, 0, false, false, 2, 60 },
+#ifdef HAVE_X86_SIMD
+	{ "fixed-avx2", ENGINE_SCATTER, ACCUM_FIXED, "avx2", 1, 0, 0, 1, 0, false, false, 2, 60 },
+	{ "fixed-avx512", ENGINE_SCATTER, ACCUM_FIXED, "avx512", 1, 0, 0, 1, 0, false, false, 2, 60 },
+#endif
+	{ "threads", ENGINE_SCATTER, ACCUM_DOUBLE, NULL, 4, 0, 0, 1, 0, false, false, 1, 80 },
+	{ "stream", ENGINE_SCATTER, ACCUM_DOUBLE, NULL, 1, 0, 0, 1, 0, true, false, 1, 80 },
+	{ "table-file", ENGINE_SCATTER, ACCUM_DOUBLE, "scalar", 1, 0, 0, 1, 0, false, true, 1, 80 },
+	{ "gather", ENGINE_GATHER, ACCUM_DOUBLE, NULL, 1, 0, 0, 1, 0, false, false, 1, 75 },
+	{ "gather-threads", ENGINE_GATHER, ACCUM_DOUBLE, NULL, 4, 0, 0, 1, 0, false, false, 1, 75 },
+	{ "quantized", ENGINE_SCATTER, ACCUM_DOUBLE, NULL, 1, 32, 16, 1, 0, false, false, 5, 55 },
+	{ "quantized-fixed", ENGINE_SCATTER, ACCUM_FIXED, NULL, 4, 8, 4, 1, 0, false, false, 16, 44 },
+	/* -r loses some coverage at the silhouette, in alpha only */
+	{ "scale", ENGINE_SCATTER, ACCUM_DOUBLE, NULL, 1, 0, 0, 0.5, 0, false, false, 24, 45 },
+	/* -t is a bound on the error, so sat bounds are it plus one for rounding */
+	{ "sat", ENGINE_SAT, ACCUM_DOUBLE, NULL, 1, 0, 0, 1, 2, false, false, 3, 70 },
+	{ "sat-threads", ENGINE_SAT, ACCUM_FLOAT, NULL, 4, 0, 0, 1, 8, false, false, 9, 60 },
+	{ "sat-loose", ENGINE_SAT, ACCUM_DOUBLE, NULL, 1, 0, 0, 1, 32, false, false, 33, 45 },
+};
+
+static const bench_template_t selftest_templates[] = {
+	{ "mug-quarter", 0.25 },
+	{ "mug-small", 0.5 },
+};
+
+static const char *selftest_arts[] = { "opaque", "blocks", "soft" };
+
+/* bench_patch() art, with a few more alpha levels for "soft" */
+static image_file_t *
+selftest_patch( unsigned long int width, unsigned long int height,
+		unsigned int art ) /* {{{ */
+{
+	image_file_t *image = bench_patch( width, height, art == 1 ? 50 : 100 );
+	unsigned long int x, y;
+
+	if ( art == 2 )
+		for ( y = 0; y < height; y++ )
+		{
+			pixel_rgba_t *row = (pixel_rgba_t *) image->row_pointers[ y ];
+			for ( x = 0; x < width; x++ )
+				row[ x ].a = ( x * 255 / width + y * 255 / height ) / 2;
+		}
+
+	return image;
+} /* }}} */
+
+/*
+ * The reference: the table build and the per-pixel splat and normalize loop
+ * of the first bender, frozen, with no code shared with the paths it checks.
+ * Each kernel is splatted as soon as it is built instead of kept in a
+ * table. Taps off the canvas are skipped, the original wrote past it.
+ */
+typedef struct selftest_reference_circle_s
+{
+	long int outx;
+	long int outy;
+	unsigned long int width;
+	unsigned long int height;
+	double pixel[];
+} selftest_reference_circle_t;
+
+static double
+selftest_reference_dist( const coord_t *a, const coord_t *b ) /* {{{ */
+{
+	double x = b->x - a->x;
+	double y = b->y - a->y;
+	return sqrt( x * x + y * y );
+} /* }}} */
 
-/* calculate intersection of two lines, each one defined by 2 points */
 static coord_t
-calc_intersection(
-		const coord_t * restrict a,
-		const coord_t * restrict b,
-		const coord_t * restrict c,
-		const coord_t * restrict d ) /* {{{ */
+selftest_reference_intersection( const coord_t *a, const coord_t *b,
+		const coord_t *c, const coord_t *d ) /* {{{ */
 {
-	coord_t v1, v2;
+	coord_t v1, v2, out;
 	double down, k;
 
-	v1 = coord_subst( a, b );
-	v2 = coord_subst( c, d );
+	v1.x = a->x - b->x;
+	v1.y = a->y - b->y;
+	v2.x = c->x - d->x;
+	v2.y = c->y - d->y;
 
 	down = v1.x * v2.y - v1.y * v2.x;
 	if ( ! down )
@@ -346,14 +6363,85 @@ calc_intersection(
 
 	k = v2.y * ( c->x - a->x ) + v2.x * ( a->y - c->y );
 
-	v2 = coord_scale( &v1, k / down );
-	return coord_add( a, &v2 );
+	out.x = a->x + v1.x * ( k / down );
+	out.y = a->y + v1.y * ( k / down );
+	return out;
+} /* }}} */
+
+static coord_t *
+selftest_reference_hiperbolic( const coord_t *origin, const coord_t *a,
+		const coord_t *b, unsigned long int divisions ) /* {{{ */
+{
+	unsigned long int i;
+	double d1, d2, h, m;
+	coord_t v1, *out;
+
+	d1 = selftest_reference_dist( origin, a );
+	d2 = selftest_reference_dist( origin, b );
+
+	h = (double) divisions * d2 / ( d2 - d1 );
+	m = - h * d1;
+
+	v1.x = a->x - origin->x;
+	v1.y = a->y - origin->y;
+
+	out = malloc( sizeof( coord_t ) * divisions );
+	if ( !out )
+		die( "Cannot allocate self-test memory" );
+
+	for ( i = 0; i < divisions; i++ )
+	{
+		double y = m / ( (double) i - h );
+		out[ i ].x = origin->x + v1.x * ( y / d1 );
+		out[ i ].y = origin->y + v1.y * ( y / d1 );
+	}
+
+	return out;
+} /* }}} */
+
+static void
+selftest_reference_ellipse( const coord_t *center, const coord_t *middle,
+		const coord_t *side, double angle_start, double angle_stop,
+		unsigned long int divisions, coord_t *output ) /* {{{ */
+{
+	double r1, r2, dist_middle, angle_r1, beta_sin, beta_cos, angle_increment;
+	unsigned long int i;
+
+	r1 = selftest_reference_dist( center, side );
+	dist_middle = selftest_reference_dist( center, middle );
+	angle_r1 = atan2( side->y - center->y, side->x - center->x );
+
+	beta_sin = sin( angle_r1 );
+	beta_cos = cos( angle_r1 );
+
+	{
+		double angle_middle = atan2( middle->y - center->y, middle->x - center->x );
+		double alpha = - angle_r1 + angle_middle;
+		double alpha_sin, alpha_cos, under;
+		alpha_sin = sin( alpha );
+		alpha_cos = cos( alpha );
+		under = r1 * r1 - ( dist_middle * alpha_cos ) * ( dist_middle * alpha_cos );
+		if ( under <= 0 )
+			die( "Wrong distance in half_ellipse" );
+		r2 = ( dist_middle * r1 * alpha_sin ) / sqrt( under );
+	}
+
+	angle_increment = ( angle_stop - angle_start ) / ( divisions - 1 );
+	for ( i = 0; i < divisions; i++ )
+	{
+		double alpha = angle_start + i * angle_increment;
+		double alpha_sin, alpha_cos;
+		alpha_sin = sin( alpha );
+		alpha_cos = cos( alpha );
+		output[ i ].x = center->x + r1 * alpha_cos * beta_cos - r2 * alpha_sin * beta_sin;
+		output[ i ].y = center->y + r1 * alpha_cos * beta_sin + r2 * alpha_sin * beta_cos;
+	}
 } /* }}} */
 
-static bokeh_circle_t *
-calc_bokeh_circle( const coord_t *out, double r ) /* {{{ */
+static selftest_reference_circle_t *
+selftest_reference_circle( const coord_t *out, double r ) /* {{{ */
 {
-	bokeh_circle_t *circle;
+	selftest_reference_circle_t *circle;
 	unsigned long int x, y, width, height;
 	double dy1, dy2, dx1, dx2, tmp, cx, cy, sum = 0;
 	if ( r < 0.75 )
@@ -371,10 +6459,11 @@ calc_bokeh_circle( const coord_t *out, double r ) /* {{{ */
 	width = ceil( cx + r + 0.5 );
 	height = ceil( cy + r + 0.5 );
 
-	circle = malloc( sizeof( bokeh_circle_t ) + sizeof( double ) * width * height );
+	circle = malloc( sizeof( selftest_reference_circle_t ) + sizeof( double ) * width * height );
+	if ( !circle )
+		die( "Cannot allocate self-test memory" );
 	circle->width = width;
 	circle->height = height;
-	/* sould be integers, but it is safer to round */
 	circle->outx = round( out->x - cx );
 	circle->outy = round( out->y - cy );
 
@@ -432,190 +6521,106 @@ calc_bokeh_circle( const coord_t *out, double r ) /* {{{ */
 	return circle;
 } /* }}} */
 
-static coord_t *
-calc_hiperbolic_distribution(
-		const coord_t * restrict origin,
-		const coord_t * restrict a,
-		const coord_t * restrict b,
-		unsigned long int divisions ) /* {{{ */
-{
-	unsigned long int i;
-	double d1, d2, h, m;
-	coord_t v1, v2, *out;
-
-	d1 = coord_dist( origin, a );
-	d2 = coord_dist( origin, b );
-
-	h = (double) divisions * d2 / ( d2 - d1 );
-	m = - h * d1;
-
-	v1 = coord_subst( a, origin );
-	/*v1.x = a->x - origin->x;
-	v1.y = a->y - origin->y;*/
-
-	out = malloc( sizeof( coord_t ) * divisions );
-
-	for ( i = 0; i < divisions; i++ )
-	{
-		double y = m / ( (double) i - h );
-		v2 = coord_scale( &v1, y / d1 );
-		/*v2.x = v1.x * y / d1;
-		v2.y = v1.y * y / d1;*/
-		out[ i ] = coord_add( origin, &v2 );
-		/*out[ i ].x = origin->x + v2.x;
-		out[ i ].y = origin->y + v2.y;*/
-	}
-
-	return out;
-} /* }}} */
-
-static void
-calc_half_ellipse(
-		const coord_t * const restrict center,
-		const coord_t * const restrict middle,
-		const coord_t * const restrict side,
-		double angle_start, double angle_stop, unsigned long int divisions,
-		coord_t * restrict output ) /* {{{ */
+/*
+ * Box filters the accumulator down to scale, pixel x covering x .. x + 1
+ * and output pixel X covering X / scale .. ( X + 1 ) / scale, one axis at a
+ * time. Sums stay premultiplied and unclamped, so this is what a scaled
+ * table claims to render, see calc_transform_table().
+ */
+static pixel_partial_t *
+selftest_reference_downscale( pixel_partial_t *ppix, unsigned long int width,
+		unsigned long int height, double scale,
+		unsigned long int *out_width, unsigned long int *out_height ) /* {{{ */
 {
-	double r1, r2, dist_middle, angle_r1, beta_sin, beta_cos, angle_increment;
-	unsigned long int i;
-
-	r1 = coord_dist( center, side );
-	dist_middle = coord_dist( center, middle );
-	angle_r1 = atan2( side->y - center->y, side->x - center->x );
-
-	beta_sin = sin( angle_r1 );
-	beta_cos = cos( angle_r1 );
+	unsigned long int sw = floor( width * scale + 0.5 ), sh = floor( height * scale + 0.5 );
+	unsigned long int y, i, pass;
+	pixel_partial_t *tmp, *out;
 
-	{
-		double angle_middle = atan2( middle->y - center->y, middle->x - center->x );
-		double alpha = - angle_r1 + angle_middle;
-		double alpha_sin, alpha_cos, under;
-		alpha_sin = sin( alpha );
-		alpha_cos = cos( alpha );
-		under = r1 * r1 - ( dist_middle * alpha_cos ) * ( dist_middle * alpha_cos );
-		if ( under <= 0 )
-			die( "Wrong distance in half_ellipse" );
-		r2 = ( dist_middle * r1 * alpha_sin ) / sqrt( under );
-	}
+	tmp = calloc( sizeof( pixel_partial_t ), sw * height );
+	out = calloc( sizeof( pixel_partial_t ), sw * sh );
+	if ( !tmp || !out )
+		die( "Cannot allocate self-test memory" );
 
-	angle_increment = ( angle_stop - angle_start ) / ( divisions - 1 );
-	for ( i = 0; i < divisions; i++ )
+	for ( pass = 0; pass < 2; pass++ )
 	{
-		double alpha = angle_start + i * angle_increment;
-		double alpha_sin, alpha_cos;
-		alpha_sin = sin( alpha );
-		alpha_cos = cos( alpha );
-		output[ i ].x = center->x + r1 * alpha_cos * beta_cos - r2 * alpha_sin * beta_sin;
-		output[ i ].y = center->y + r1 * alpha_cos * beta_sin + r2 * alpha_sin * beta_cos;
-	}
-} /* }}} */
-
-#define BOKEH_SHARP 2.5
-#define BOKEH_BLURRY 5
-static bokeh_circle_t **
-calc_transform_line_bokeh(
-		const coord_t * restrict points, unsigned long int count,
-		const coord_t * restrict e_f1,
-		const coord_t * restrict e_f2,
-		double r1, double r2 ) /* {{{ */
-{
-	double d, bokeh_inc;
-	unsigned long int i;
-	bokeh_circle_t **output;
-
-	output = malloc( sizeof( bokeh_circle_t * ) * count );
+		unsigned long int count = pass ? sh : sw, size = pass ? height : width;
+		unsigned long int lines = pass ? sw : height;
+		const pixel_partial_t *from = pass ? tmp : ppix;
+		pixel_partial_t *to = pass ? out : tmp;
 
-	/* at distance r1 bokeh is BOKEH_SHARP
-	 * at distance r2 bokeh is BOKEH_BLURRY
-	 */
-	bokeh_inc = ( BOKEH_BLURRY - BOKEH_SHARP ) / ( r2 - r1 );
-	for ( i = 0; i < count; i++ )
-	{
-		const coord_t *p = points + i;
-		double ball_r = BOKEH_SHARP;
-		d = coord_dist( e_f1, p ) + coord_dist( e_f2, p );
-		if ( d < r1 )
-		{
-			ball_r = BOKEH_SHARP;
-		}
-		else
+		for ( i = 0; i < count; i++ )
 		{
-			ball_r = BOKEH_SHARP + ( d - r1 ) * bokeh_inc;
-		}
-
-		output[ i ] = calc_bokeh_circle( p, ball_r );
-	}
-
-	return output;
-} /* }}} */
-
-#ifdef __GNUC__
-static bokeh_circle_t **
-calc_transform_line_sharp( const coord_t *points, unsigned long int count )
-	__attribute__ ((unused));
-#endif
-static bokeh_circle_t **
-calc_transform_line_sharp( const coord_t *points, unsigned long int count ) /* {{{ */
-{
-	unsigned long int i;
-	bokeh_circle_t **output;
+			double start = i / scale, stop = ( i + 1 ) / scale;
+			unsigned long int j;
 
-	output = malloc( sizeof( bokeh_circle_t * ) * count );
-	for ( i = 0; i < count; i++ )
-	{
-		const coord_t *p = points + i;
-		output[ i ] = calc_bokeh_circle( p, BOKEH_SHARP );
+			for ( j = floor( start ); j < size && j < stop; j++ )
+			{
+				double w = ( ( j + 1 < stop ? j + 1 : stop ) - ( j > start ? j : start ) ) * scale;
+				for ( y = 0; y < lines; y++ )
+				{
+					const pixel_partial_t *p;
+					pixel_partial_t *q;
+					if ( pass )
+					{
+						p = from + j * sw + y;
+						q = to + i * sw + y;
+					}
+					else
+					{
+						p = from + y * width + j;
+						q = to + y * sw + i;
+					}
+					q->r += w * p->r;
+					q->g += w * p->g;
+					q->b += w * p->b;
+					q->a += w * p->a;
+				}
+			}
+		}
 	}
 
-	return output;
+	free( tmp );
+	*out_width = sw;
+	*out_height = sh;
+	return out;
 } /* }}} */
 
-static transform_table_t *
-calc_transform_table( coord_t *list, long int points ) /* {{{ */
+/* patch rendered on the whole canvas at scale, as the first bender did */
+static image_file_t *
+selftest_reference_render( const table_params_t *params, const image_file_t *patch,
+		double scale ) /* {{{ */
 {
+	const coord_t *list = params->list;
 	coord_t m1, m2, end;
-	coord_t *h_c, *h_t, *h_s;
-	coord_t *ellipse_tmp;
-	transform_table_t *output;
+	coord_t *h_c, *h_t, *h_s, *ellipse_tmp;
 	unsigned long int input_width, input_height, output_width, output_height;
-	double angle_start, angle_stop;
-	double bokeh_r1, bokeh_r2;
-	int i;
+	long int x, y, bx, by;
+	double bokeh_r1, bokeh_r2, bokeh_inc, alpha_fix;
+	pixel_partial_t *ppix;
+	image_file_t *img_out;
 
 	input_width = list[ POINT_PATCH_SIZE ].x;
 	input_height = list[ POINT_PATCH_SIZE ].y;
 	output_width = list[ POINT_BG_SIZE ].x;
 	output_height = list[ POINT_BG_SIZE ].y;
 
-	m1 = coord_middle( list + POINT_LEFT_TOP, list + POINT_RIGHT_TOP );
-	m2 = coord_middle( list + POINT_LEFT_BOTTOM, list + POINT_RIGHT_BOTTOM );
+	m1.x = ( list[ POINT_LEFT_TOP ].x + list[ POINT_RIGHT_TOP ].x ) * 0.5;
+	m1.y = ( list[ POINT_LEFT_TOP ].y + list[ POINT_RIGHT_TOP ].y ) * 0.5;
+	m2.x = ( list[ POINT_LEFT_BOTTOM ].x + list[ POINT_RIGHT_BOTTOM ].x ) * 0.5;
+	m2.y = ( list[ POINT_LEFT_BOTTOM ].y + list[ POINT_RIGHT_BOTTOM ].y ) * 0.5;
 
-	end = calc_intersection( list + POINT_LEFT_TOP, list + POINT_LEFT_BOTTOM,
+	end = selftest_reference_intersection( list + POINT_LEFT_TOP, list + POINT_LEFT_BOTTOM,
 			list + POINT_RIGHT_TOP, list + POINT_RIGHT_BOTTOM );
 
-	h_c = calc_hiperbolic_distribution( &end, &m1, &m2, input_height );
+	h_c = selftest_reference_hiperbolic( &end, &m1, &m2, input_height );
+	h_t = selftest_reference_hiperbolic( &end,
+			list + POINT_MIDDLE_TOP, list + POINT_MIDDLE_BOTTOM, input_height );
+	h_s = selftest_reference_hiperbolic( &end,
+			list + POINT_LEFT_TOP, list + POINT_LEFT_BOTTOM, input_height );
 
-	h_t = calc_hiperbolic_distribution( &end,
-			list + POINT_MIDDLE_TOP, list + POINT_MIDDLE_BOTTOM,
-			input_height );
-	h_s = calc_hiperbolic_distribution( &end,
-			list + POINT_LEFT_TOP, list + POINT_LEFT_BOTTOM,
-			input_height );
-
-	angle_start = list[ POINT_ANGLES ].x;
-	angle_stop = list[ POINT_ANGLES ].y;
 	bokeh_r1 = list[ POINT_FOCUS_R ].x;
 	bokeh_r2 = list[ POINT_FOCUS_R ].y;
-
-	ellipse_tmp = malloc( sizeof( coord_t ) * input_width );
-	output = malloc( sizeof( transform_table_t )
-			+ sizeof( bokeh_circle_t ** ) * input_height );
-
-	output->patch_width = input_width;
-	output->patch_height = input_height;
-	output->output_width = output_width;
-	output->output_height = output_height;
+	bokeh_inc = ( BOKEH_BLURRY - BOKEH_SHARP ) / ( bokeh_r2 - bokeh_r1 );
 
 	{
 		double x1, x2;
@@ -624,121 +6629,52 @@ calc_transform_table( coord_t *list, long int points ) /* {{{ */
 		if ( x2 > x1 )
 			x1 = x2;
 		if ( x1 * 1.5 > input_width )
-		{
-			output->alpha_fix = x1 * 1.5 / input_width;
-		}
+			alpha_fix = x1 * 1.5 / input_width;
 		else
-		{
-			output->alpha_fix = 1;
-		}
-	}
-
-	for ( i = 0; i < input_height; i++ )
-	{
-		calc_half_ellipse(
-			h_c + i, h_t + i, h_s + i,
-			angle_start, angle_stop,
-			input_width,
-			ellipse_tmp
-		);
-
-		/* output->row_pointers[ i ] = calc_transform_line_sharp( ellipse_tmp, input_width ); */
-		output->row_pointers[ i ] = calc_transform_line_bokeh(
-				ellipse_tmp, input_width,
-				list + POINT_FOCUS_F1, list + POINT_FOCUS_F2,
-				bokeh_r1, bokeh_r2
-				);
+			alpha_fix = 1;
 	}
-	free( ellipse_tmp );
-	free( h_c );
-	free( h_t );
-	free( h_s );
-
-	return output;
-} /* }}} */
 
-static void
-destroy_transform_table( transform_table_t **tt )
-{
-	int i, j;
+	ellipse_tmp = malloc( sizeof( coord_t ) * input_width );
+	ppix = calloc( sizeof( pixel_partial_t ), output_width * output_height );
+	if ( !ellipse_tmp || !ppix )
+		die( "Cannot allocate self-test memory" );
 
-	for ( i = 0; i < (*tt)->patch_height; i++ )
+	for ( y = 0; y < input_height; y++ )
 	{
-		bokeh_circle_t **row = (*tt)->row_pointers[ i ];
-		for ( j = 0; j < (*tt)->patch_width; j++ )
-		{
-			free( row[ j ] );
-		}
-		free( row );
-	}
-	free( *tt );
-	*tt = NULL;
-}
-
-static void
-image_process( transform_table_t *transform_table,
-		const char *in_file, const char *out_file,
-		long int move_x, long int move_y ) /* {{{ */
-{
-	printf( "Image process %s -> %s with +%ld+%ld\n",
-			in_file, out_file,
-			move_x, move_y
-		);
-
-	image_file_t *img_in;
-	img_in = image_from_file( in_file );
-
-	long int do_width, do_height;
+		pixel_rgba_t *in_row = (pixel_rgba_t *) patch->row_pointers[ y ];
 
-	do_width = transform_table->patch_width;
-	if ( img_in->width < do_width )
-		do_width = img_in->width;
-	do_height = transform_table->patch_height;
-	if ( img_in->height < do_height )
-		do_height = img_in->height;
-
-	int x, y, bx, by;
-	pixel_partial_t *ppix;
-	ppix = calloc( sizeof( pixel_partial_t ), transform_table->output_width * transform_table->output_height );
-
-	for ( y = move_y; y < do_height; y++ )
-	{
-		bokeh_circle_t **bc_row;
-		bc_row = transform_table->row_pointers[ y ];
-		pixel_rgba_t *in_row = (pixel_rgba_t *) img_in->row_pointers[ y ];
+		selftest_reference_ellipse( h_c + y, h_t + y, h_s + y,
+				list[ POINT_ANGLES ].x, list[ POINT_ANGLES ].y, input_width, ellipse_tmp );
 
-		for ( x = move_x; x < do_width; x++ )
+		for ( x = 0; x < input_width; x++ )
 		{
-			bokeh_circle_t *bokeh = bc_row[ x ];
-			pixel_rgba_t *p_in;
-			p_in = in_row + x;
-			
-			if ( bokeh->outx >= transform_table->output_width )
-			{
-				printf( "Pixel [%dx%d] out of horizontal bounds, max: %ld, found %ld\n",
-					x, y, transform_table->output_width, bokeh->outx );
-				continue;
-			}
-			if ( bokeh->outy >= transform_table->output_height )
-			{
-				printf( "Pixel [%dx%d] out of horizontal bounds, max: %ld, found %ld\n",
-					x, y, transform_table->output_height, bokeh->outy );
-				continue;
-			}
+			const coord_t *p = ellipse_tmp + x;
+			pixel_rgba_t *p_in = in_row + x;
+			selftest_reference_circle_t *bokeh;
+			double ball_r, d;
+
+			d = selftest_reference_dist( list + POINT_FOCUS_F1, p )
+				+ selftest_reference_dist( list + POINT_FOCUS_F2, p );
+			if ( d < bokeh_r1 )
+				ball_r = BOKEH_SHARP;
+			else
+				ball_r = BOKEH_SHARP + ( d - bokeh_r1 ) * bokeh_inc;
+			bokeh = selftest_reference_circle( p, ball_r );
 
-			//printf( "bokeh size: %d %d\n", bokeh->height, bokeh->width );
 			for ( by = 0; by < bokeh->height; by++ )
 			{
 				for ( bx = 0; bx < bokeh->width; bx++ )
 				{
 					double bokeh_alpha = bokeh->pixel[ by * bokeh->width + bx ];
+					long int ox = bokeh->outx + bx, oy = bokeh->outy + by;
 					pixel_partial_t *p_out;
-					p_out = ppix
-						+ ( bokeh->outy + by ) * transform_table->output_width
-						+ ( bokeh->outx + bx );
+
+					if ( ox < 0 || oy < 0 || ox >= output_width || oy >= output_height )
+						continue;
+					p_out = ppix + oy * output_width + ox;
 
 					bokeh_alpha *= ( double ) p_in->a / 255.0;
-					bokeh_alpha *= transform_table->alpha_fix;
+					bokeh_alpha *= alpha_fix;
 
 					p_out->r += bokeh_alpha * p_in->r;
 					p_out->g += bokeh_alpha * p_in->g;
@@ -746,18 +6682,29 @@ image_process( transform_table_t *transform_table,
 					p_out->a += bokeh_alpha;
 				}
 			}
+			free( bokeh );
 		}
 	}
+	free( ellipse_tmp );
+	free( h_c );
+	free( h_t );
+	free( h_s );
 
-	image_file_t *img_out;
-	img_out = image_new( transform_table->output_width, transform_table->output_height );
+	if ( scale != 1 )
+	{
+		pixel_partial_t *full = ppix;
+		ppix = selftest_reference_downscale( full, output_width, output_height, scale,
+				&output_width, &output_height );
+		free( full );
+	}
 
-	for ( y = 0; y < transform_table->output_height; y++ )
+	img_out = image_new( output_width, output_height );
+	for ( y = 0; y < output_height; y++ )
 	{
 		pixel_rgba_t *row = (pixel_rgba_t *) img_out->row_pointers[ y ];
-		for ( x = 0; x < transform_table->output_width; x++ )
+		for ( x = 0; x < output_width; x++ )
 		{
-			pixel_partial_t *p_in = ppix + y * transform_table->output_width + x;
+			pixel_partial_t *p_in = ppix + y * output_width + x;
 			pixel_rgba_t *p_out = row + x;
 			if ( ! p_in->a )
 				continue;
@@ -777,73 +6724,800 @@ image_process( transform_table_t *transform_table,
 			p_out->b = p_in->b * fix;
 		}
 	}
-
-	image_write( img_out, out_file );
-	image_destroy( &img_out );
-	image_destroy( &img_in );
 	free( ppix );
+
+	return img_out;
 } /* }}} */
 
-int
-main( int argc, char **argv )
+/* box image of tt on its whole canvas */
+static image_file_t *
+selftest_canvas( image_file_t *img, const transform_table_t *tt ) /* {{{ */
+{
+	image_file_t *canvas = image_new( tt->output_width, tt->output_height );
+	unsigned long int y;
+
+	for ( y = 0; y < img->height; y++ )
+		memcpy( (pixel_rgba_t *) canvas->row_pointers[ tt->box.y + y ] + tt->box.x,
+				img->row_pointers[ y ], sizeof( pixel_rgba_t ) * img->width );
+	image_destroy( &img );
+
+	return canvas;
+} /* }}} */
+
+/* largest channel errors and PSNR, 0 if the images are the same */
+static double
+selftest_compare( const image_file_t *ref, const image_file_t *img,
+		double max_error[ 4 ] ) /* {{{ */
 {
-	int i, count = 24;
+	unsigned long int x, y, covered = 0;
+	double se = 0;
+	int c;
 
-	if ( argc - 1 < 26 )
+	if ( ref->width != img->width || ref->height != img->height )
+		die( "Self-test canvas %lux%lu does not match the reference %lux%lu",
+				img->width, img->height, ref->width, ref->height );
+
+	for ( c = 0; c < 4; c++ )
+		max_error[ c ] = 0;
+	for ( y = 0; y < ref->height; y++ )
 	{
-		printf( "%s requires at least 26 arguments. You should try not run it manually.\n",
-				argv[0]
-			  );
-		exit(0);
+		const pixel_rgba_t *a = (const pixel_rgba_t *) ref->row_pointers[ y ];
+		const pixel_rgba_t *b = (const pixel_rgba_t *) img->row_pointers[ y ];
+		for ( x = 0; x < ref->width; x++ )
+		{
+			double d[ 4 ];
+			if ( !a[ x ].a && !b[ x ].a )
+				continue;
+			covered++;
+			d[ 0 ] = ( a[ x ].r * a[ x ].a - b[ x ].r * b[ x ].a ) / 255.0;
+			d[ 1 ] = ( a[ x ].g * a[ x ].a - b[ x ].g * b[ x ].a ) / 255.0;
+			d[ 2 ] = ( a[ x ].b * a[ x ].a - b[ x ].b * b[ x ].a ) / 255.0;
+			d[ 3 ] = (double) a[ x ].a - b[ x ].a;
+			for ( c = 0; c < 4; c++ )
+			{
+				se += d[ c ] * d[ c ];
+				if ( fabs( d[ c ] ) > max_error[ c ] )
+					max_error[ c ] = fabs( d[ c ] );
+			}
+		}
 	}
 
-	double tmp = 0;
-	coord_t data[ 12 ];
+	if ( !se )
+		return 0;
+	return 10 * log10( 255.0 * 255.0 * 4 * covered / se );
+} /* }}} */
 
-	for ( i = 0; i < 24; i++ )
+/* renders in_path with the table and options of sc, as full canvas */
+static image_file_t *
+selftest_render( const transform_table_t *tt, const selftest_case_t *sc,
+		const render_opts_t *ro, const char *in_path, const char *out_path ) /* {{{ */
+{
+	image_input_t *input = image_input_open( in_path );
+	image_file_t *img;
+
+	if ( sc->stream )
 	{
-		char *arg = argv[ i + 1 ];
-		char *tail = NULL;
-		char *end = arg + strlen( arg );
-		double out;
-		out = strtod( arg, &tail );
-		// printf( "- %p, %p, %f\n", argv[i], tail, out );
-		//
-		if ( tail != end )
+		render_scatter_stream( tt, ro->accum, ro->fixed_weights, ro->splat,
+				input, tt->patch_width, tt->patch_height, 0, 0, out_path, NULL, NULL );
+		image_input_close( &input );
+		return image_from_file( out_path );
+	}
+
+	img = image_new( tt->box.width, tt->box.height );
+	if ( sc->engine == ENGINE_GATHER )
+		render_gather( ro->gather, ro->workers, input,
+				tt->patch_width, tt->patch_height, 0, 0, img, NULL );
+	else
+		render_scatter( tt, ro->workers, ro->accum, ro->fixed_weights, ro->splat,
+				input, tt->patch_width, tt->patch_height, 0, 0, img, NULL );
+	image_input_close( &input );
+
+	return selftest_canvas( img, tt );
+} /* }}} */
+
+/* returns the number of failed checks */
+static unsigned int
+selftest_run( unsigned int templates ) /* {{{ */
+{
+	unsigned int t, a, c, checks = 0, failed = 0, skipped = 0;
+	unsigned int arts = BENCH_COUNT( selftest_arts );
+	char *in_path[ BENCH_COUNT( selftest_arts ) ];
+	char *out_path = bench_temp_file();
+
+	for ( t = 0; t < templates; t++ )
+	{
+		const bench_template_t *bt = selftest_templates + t;
+		image_file_t *reference[ BENCH_COUNT( selftest_arts ) ];
+		image_file_t *patch[ BENCH_COUNT( selftest_arts ) ];
+		geometry_cache_t geometry = { NULL, NULL };
+		table_params_t base, ref_params;
+		transform_table_t *ref_tt;
+		const char *source;
+
+		memset( &base, 0, sizeof( base ) );
+		base.scale = 1;
+		bench_params( bt, bt->scale, &base, &ref_params );
+		ref_tt = calc_transform_table( &ref_params, geometry_cache_grid( &geometry,
+				&ref_params, NULL, NULL, &source ), NULL );
+
+		for ( a = 0; a < arts; a++ )
 		{
-			die( "Invalid number '%s' in argument %d", arg, i );
+			patch[ a ] = selftest_patch( ref_tt->patch_width, ref_tt->patch_height, a );
+			in_path[ a ] = bench_temp_file();
+			image_write( patch[ a ], in_path[ a ], NULL );
+			reference[ a ] = selftest_reference_render( &ref_params, patch[ a ], 1 );
 		}
-		//printf( "number: %f <- %s\n", out, arg );
-		if ( i % 2 )
+
+		for ( c = 0; c < BENCH_COUNT( selftest_cases ); c++ )
 		{
-			data[ i / 2 ].x = tmp;
-			data[ i / 2 ].y = out;
+			const selftest_case_t *sc = selftest_cases + c;
+			const splat_funcs_t *splat = splat_levels;
+			table_params_t params = ref_params;
+			transform_table_t *tt = ref_tt;
+			render_opts_t ro;
+			unsigned int i;
+
+			if ( sc->splat )
+			{
+				for ( i = 0; i < BENCH_COUNT( splat_levels ); i++ )
+					if ( !strcmp( splat_levels[ i ].name, sc->splat ) )
+						splat = splat_levels + i;
+				if ( !splat_supported( splat ) )
+				{
+					printf( "{\"template\":\"%s\",\"case\":\"%s\",\"skipped\":true}\n",
+							bt->name, sc->name );
+					skipped++;
+					continue;
+				}
+			}
+			else
+			{
+				splat = splat_select( NULL );
+			}
+
+			memset( &ro, 0, sizeof( ro ) );
+			ro.engine = sc->engine;
+			ro.accum = sc->accum;
+			ro.splat = splat;
+			if ( sc->threads > 1 )
+				ro.workers = workers_new( sc->threads );
+
+			params.radius_steps = sc->radius_steps;
+			params.phase_steps = sc->phase_steps;
+			params.scale = sc->scale;
+			if ( sc->engine == ENGINE_SAT )
+				params.sat_tolerance = sc->sat_tolerance;
+			if ( sc->table_file )
+			{
+				transform_table_write( ref_tt, out_path, &ref_params );
+				tt = transform_table_from_file( out_path, &ref_params );
+				if ( !tt )
+					die( "Self-test cannot map table file '%s'", out_path );
+			}
+			else if ( memcmp( &params, &ref_params, sizeof( params ) ) )
+			{
+				tt = calc_transform_table( &params, geometry_cache_grid( &geometry,
+						&params, NULL, ro.workers, &source ), ro.workers );
+			}
+			render_opts_bind( &ro, tt );
+
+			for ( a = 0; a < arts; a++ )
+			{
+				image_file_t *ref = reference[ a ], *img, *scaled = NULL;
+				double max_error[ 4 ], psnr, worst = 0;
+				bool pass;
+				int k;
+
+				img = selftest_render( tt, sc, &ro, in_path[ a ], out_path );
+				if ( sc->scale != 1 )
+					ref = scaled = selftest_reference_render( &ref_params, patch[ a ], sc->scale );
+				psnr = selftest_compare( ref, img, max_error );
+				for ( k = 0; k < 4; k++ )
+					if ( max_error[ k ] > worst )
+						worst = max_error[ k ];
+				pass = worst <= sc->max_error && ( !psnr || psnr >= sc->min_psnr );
+
+				printf( "{\"template\":\"%s\",\"art\":\"%s\",\"case\":\"%s\","
+						"\"engine\":\"%s\",\"accum\":\"%s\",\"splat\":\"%s\",\"threads\":%u,"
+						"\"max_error\":[%.1f,%.1f,%.1f,%.1f],",
+						bt->name, selftest_arts[ a ], sc->name,
+						engine_names[ sc->engine ], accum_names[ sc->accum ], splat->name,
+						sc->threads, max_error[ 0 ], max_error[ 1 ], max_error[ 2 ],
+						max_error[ 3 ] );
+				if ( psnr )
+					printf( "\"psnr\":%.2f,", psnr );
+				else
+					printf( "\"psnr\":null," );
+				printf( "\"pass\":%s}\n", pass ? "true" : "false" );
+				fflush( stdout );
+
+				checks++;
+				if ( !pass )
+					failed++;
+				image_destroy( &img );
+				if ( scaled )
+					image_destroy( &scaled );
+			}
+
+			render_opts_release( &ro );
+			if ( tt != ref_tt )
+				destroy_transform_table( &tt );
+			if ( ro.workers )
+				workers_destroy( &ro.workers );
 		}
-		else
+
+		for ( a = 0; a < arts; a++ )
 		{
-			tmp = out;
+			image_destroy( &reference[ a ] );
+			image_destroy( &patch[ a ] );
+			unlink( in_path[ a ] );
+			free( in_path[ a ] );
+		}
+		destroy_transform_table( &ref_tt );
+		geometry_cache_clear( &geometry );
+	}
+
+	printf( "{\"checks\":%u,\"failed\":%u,\"skipped_cases\":%u}\n", checks, failed, skipped );
+	unlink( out_path );
+	free( out_path );
+
+	return failed;
+} /* }}} */
+
+/* "LEVEL[:FILTER,...]" of -z */
+static void
+parse_png_encoding( const char *value, output_opts_t *oo ) /* {{{ */
+{
+	static const struct { const char *name; int mask; } filters[] = {
+		{ "none", PNG_FILTER_NONE },
+		{ "sub", PNG_FILTER_SUB },
+		{ "up", PNG_FILTER_UP },
+		{ "avg", PNG_FILTER_AVG },
+		{ "paeth", PNG_FILTER_PAETH },
+		{ "all", PNG_ALL_FILTERS },
+	};
+	const char *p = value;
+	char *tail;
+	unsigned int i;
+
+	oo->png_level = strtol( p, &tail, 10 );
+	if ( tail == p || oo->png_level < 0 || oo->png_level > 9
+			|| ( *tail && *tail != ':' ) )
+		die( "Invalid png encoding '%s', expected LEVEL[:FILTER,...]", value );
+	if ( !*tail )
+		return;
+
+	oo->png_filters = 0;
+	for ( p = tail + 1; *p; p += *p == ',' )
+	{
+		size_t len = strcspn( p, "," );
+		for ( i = 0; i < sizeof( filters ) / sizeof( filters[0] ); i++ )
+			if ( strlen( filters[ i ].name ) == len && !strncmp( p, filters[ i ].name, len ) )
+				break;
+		if ( i == sizeof( filters ) / sizeof( filters[0] ) )
+			die( "Unknown png filter in '%s'", value );
+		oo->png_filters |= filters[ i ].mask;
+		p += len;
+	}
+	if ( !oo->png_filters )
+		die( "Invalid png encoding '%s', expected LEVEL[:FILTER,...]", value );
+} /* }}} */
+
+#ifdef BENDER_LIBRARY
+/*
+ * libbender, see bender.h. Previews use the same geometry, bokeh stage and
+ * scatter renderer as the command line: the grid is built for a patch
+ * decimate times smaller, which picks every decimate-th row of the full
+ * grid, and the bokeh stage scales it down to the preview canvas.
+ */
+struct bender_s
+{
+	unsigned int decimate;
+	/* numbers of the current table, as passed in */
+	table_params_t params;
+	geometry_cache_t geometry;
+	transform_table_t *tt;
+	const splat_funcs_t *splat;
+};
+
+unsigned int
+bender_api_version( void ) /* {{{ */
+{
+	return BENDER_API_VERSION;
+} /* }}} */
+
+bender_t *
+bender_new( unsigned int decimate ) /* {{{ */
+{
+	bender_t *b;
+
+	if ( !decimate )
+		return NULL;
+	b = calloc( 1, sizeof( bender_t ) );
+	if ( !b )
+		return NULL;
+	b->decimate = decimate;
+	b->splat = splat_select( NULL );
+
+	return b;
+} /* }}} */
+
+/* checks what the table builder would only die on */
+static bool
+bender_params_valid( const table_params_t *params ) /* {{{ */
+{
+	const coord_t *list = params->list;
+	int i;
+
+	for ( i = 0; i < 12; i++ )
+		if ( !isfinite( list[ i ].x ) || !isfinite( list[ i ].y ) )
+			return false;
+
+	if ( !( list[ POINT_BG_SIZE ].x >= 1 && list[ POINT_BG_SIZE ].y >= 1
+			&& list[ POINT_PATCH_SIZE ].x >= 2 && list[ POINT_PATCH_SIZE ].y >= 1
+			&& list[ POINT_FOCUS_R ].y > list[ POINT_FOCUS_R ].x ) )
+		return false;
+
+	/* parallel edges and rows the ellipses miss, die_jump is left for allocations */
+	return !table_params_check( params );
+} /* }}} */
+
+int
+bender_set_numbers( bender_t *b, const double numbers[ 24 ] ) /* {{{ */
+{
+	table_params_t params, decimated, preview;
+	const point_grid_t *grid;
+	transform_table_t *tt;
+	const char *source;
+	jmp_buf jump;
+	int i;
+
+	memset( &params, 0, sizeof( params ) );
+	for ( i = 0; i < 12; i++ )
+	{
+		params.list[ i ].x = numbers[ 2 * i ];
+		params.list[ i ].y = numbers[ 2 * i + 1 ];
+	}
+	params.scale = 1;
+	if ( b->tt && !memcmp( &params, &b->params, sizeof( params ) ) )
+		return 0;
+
+	/* the grid is decimated, the canvas is scaled by the bokeh stage */
+	decimated = params;
+	decimated.list[ POINT_PATCH_SIZE ].x = floor( params.list[ POINT_PATCH_SIZE ].x / b->decimate );
+	decimated.list[ POINT_PATCH_SIZE ].y = floor( params.list[ POINT_PATCH_SIZE ].y / b->decimate );
+	decimated.list[ POINT_BG_SIZE ].x = floor( params.list[ POINT_BG_SIZE ].x / b->decimate );
+	decimated.list[ POINT_BG_SIZE ].y = floor( params.list[ POINT_BG_SIZE ].y / b->decimate );
+	preview = params;
+	preview.scale = 1.0 / b->decimate;
+
+	/* out of memory, what was built is released and the last table kept */
+	die_jump = &jump;
+	if ( setjmp( jump ) )
+	{
+		die_jump = NULL;
+		return -1;
+	}
+	if ( !bender_params_valid( &decimated ) )
+	{
+		die_jump = NULL;
+		return -1;
+	}
+	grid = geometry_cache_grid( &b->geometry, &decimated, NULL, NULL, &source );
+	tt = calc_transform_table( &preview, grid, NULL );
+	die_jump = NULL;
+
+	if ( b->tt )
+		destroy_transform_table( &b->tt );
+	b->tt = tt;
+	b->params = params;
+
+	return 0;
+} /* }}} */
+
+void
+bender_size( const bender_t *b, unsigned long *width, unsigned long *height ) /* {{{ */
+{
+	*width = b->tt ? b->tt->output_width : 0;
+	*height = b->tt ? b->tt->output_height : 0;
+} /* }}} */
+
+/* every n-th pixel of a straight RGBA patch, box filtered over n x n around it */
+static image_input_t *
+bender_patch_input( const unsigned char *patch, unsigned long int width,
+		unsigned long int height, unsigned int n ) /* {{{ */
+{
+	image_input_t *in;
+	unsigned long int x, y, sx, sy;
+	unsigned int mark;
+
+	in = calloc( 1, sizeof( image_input_t ) );
+	if ( !in )
+		die( "Cannot allocate input memory" );
+	mark = die_hold( &in, image_input_release );
+	in->width = ( width + n - 1 ) / n;
+	in->height = ( height + n - 1 ) / n;
+	in->image = image_new( in->width, in->height );
+
+	for ( y = 0; y < in->height; y++ )
+	{
+		pixel_rgba_t *row = (pixel_rgba_t *) in->image->row_pointers[ y ];
+		unsigned long int y0 = y * n > n / 2 ? y * n - n / 2 : 0;
+		unsigned long int y1 = y * n - n / 2 + n;
+		if ( y1 > height )
+			y1 = height;
+
+		for ( x = 0; x < in->width; x++ )
+		{
+			unsigned long int x0 = x * n > n / 2 ? x * n - n / 2 : 0;
+			unsigned long int x1 = x * n - n / 2 + n;
+			double r = 0, g = 0, b = 0, a = 0;
+			if ( x1 > width )
+				x1 = width;
+
+			for ( sy = y0; sy < y1; sy++ )
+			{
+				const unsigned char *p = patch + ( sy * width + x0 ) * BYTES_PER_PIXEL;
+				for ( sx = x0; sx < x1; sx++, p += BYTES_PER_PIXEL )
+				{
+					r += p[ 0 ] * p[ 3 ];
+					g += p[ 1 ] * p[ 3 ];
+					b += p[ 2 ] * p[ 3 ];
+					a += p[ 3 ];
+				}
+			}
+			if ( !a )
+				continue;
+			row[ x ].r = round( r / a );
+			row[ x ].g = round( g / a );
+			row[ x ].b = round( b / a );
+			row[ x ].a = round( a / ( ( x1 - x0 ) * ( y1 - y0 ) ) );
+		}
+	}
+	image_input_index_image( in );
+	die_unhold( mark );
+
+	return in;
+} /* }}} */
+
+int
+bender_render( bender_t *b, const unsigned char *patch,
+		unsigned long width, unsigned long height, unsigned char *out ) /* {{{ */
+{
+	const transform_table_t *tt = b->tt;
+	image_input_t *input;
+	image_file_t *img_out;
+	long int do_width, do_height;
+	unsigned long int y;
+	jmp_buf jump;
+
+	if ( !tt )
+		return -1;
+
+	die_jump = &jump;
+	if ( setjmp( jump ) )
+	{
+		die_jump = NULL;
+		return -1;
+	}
+	input = bender_patch_input( patch, width, height, b->decimate );
+	die_hold( &input, image_input_release );
+	do_width = input->width < tt->patch_width ? input->width : tt->patch_width;
+	do_height = input->height < tt->patch_height ? input->height : tt->patch_height;
+
+	img_out = image_new( tt->box.width, tt->box.height );
+	die_hold( &img_out, image_release );
+	render_scatter( tt, NULL, ACCUM_FLOAT, NULL, b->splat,
+			input, do_width, do_height, 0, 0, img_out, NULL );
+	image_input_close( &input );
+	die_unhold( 0 );
+	die_jump = NULL;
+
+	memset( out, 0, tt->output_width * tt->output_height * BYTES_PER_PIXEL );
+	for ( y = 0; y < tt->box.height; y++ )
+		memcpy( out + ( ( tt->box.y + y ) * tt->output_width + tt->box.x ) * BYTES_PER_PIXEL,
+				img_out->row_pointers[ y ], tt->box.width * BYTES_PER_PIXEL );
+	image_destroy( &img_out );
+
+	return 0;
+} /* }}} */
+
+void
+bender_free( bender_t *b ) /* {{{ */
+{
+	if ( !b )
+		return;
+	if ( b->tt )
+		destroy_transform_table( &b->tt );
+	geometry_cache_clear( &b->geometry );
+	free( b );
+} /* }}} */
+
+/* the command line is built in as well, it keeps everything it uses referenced */
+#define main bender_main
+#endif
+
+int
+main( int argc, char **argv )
+{
+	int i, first;
+	const char *cache_dir = NULL;
+	table_params_t params;
+	render_opts_t opts = { ENGINE_SCATTER, NULL, ACCUM_DOUBLE, NULL, NULL, NULL };
+	const char *splat_name = NULL;
+	const char *daemon_path = NULL;
+	unsigned int bench_reps = 0;
+	unsigned int selftest_templates_count = 0;
+	double sat_tolerance = 2;
+	size_t table_budget = (size_t) 1024 << 20;
+	image_file_t *background = NULL;
+	unsigned int threads = 1;
+	unsigned long int count;
+	pipeline_config_t pipeline_config = { 0, { 1, 1, 1 } };
+	pipeline_t *pipeline = NULL;
+
+	/* hashed as raw memory, so padding must be zeroed as well */
+	memset( &params, 0, sizeof( params ) );
+	params.scale = 1;
+	opts.output.png_level = -1;
+	opts.output.png_filters = -1;
+
+	/* options go before the numbers, negative numbers never start with a letter */
+	for ( first = 1; first < argc; first++ )
+	{
+		char *arg = argv[ first ];
+		char *value;
+		if ( arg[0] != '-' || !isalpha( (unsigned char) arg[1] ) )
+			break;
+
+		value = arg[2] ? arg + 2 : argv[ ++first ];
+		if ( !value )
+			die( "Option '%s' requires a value", arg );
+
+		switch ( arg[1] )
+		{
+			case 'a':
+				if ( !strcmp( value, "double" ) )
+					opts.accum = ACCUM_DOUBLE;
+				else if ( !strcmp( value, "float" ) )
+					opts.accum = ACCUM_FLOAT;
+				else if ( !strcmp( value, "fixed" ) )
+					opts.accum = ACCUM_FIXED;
+				else
+					die( "Unknown accumulator '%s'", value );
+				break;
+			case 'B':
+				if ( !parse_count( value, 1, 10000, &count ) )
+					die( "Invalid number of benchmark runs '%s', expected 1 to 10000", value );
+				bench_reps = count;
+				break;
+			case 'b':
+				if ( background )
+					image_destroy( &background );
+				background = image_from_file( value );
+				opts.output.background = background;
+				break;
+			case 'c':
+				cache_dir = value;
+				break;
+			case 'd':
+				daemon_path = value;
+				break;
+			case 'e':
+				if ( !strcmp( value, "scatter" ) )
+					opts.engine = ENGINE_SCATTER;
+				else if ( !strcmp( value, "gather" ) )
+					opts.engine = ENGINE_GATHER;
+				else if ( !strcmp( value, "sat" ) )
+					opts.engine = ENGINE_SAT;
+				else
+					die( "Unknown engine '%s'", value );
+				break;
+			case 'g':
+				if ( sscanf( value, "%lux%lu", &opts.output.fit_width,
+							&opts.output.fit_height ) != 2
+						|| !opts.output.fit_width || !opts.output.fit_height )
+					die( "Invalid geometry '%s', expected WIDTHxHEIGHT", value );
+				break;
+			case 'j':
+				if ( !parse_count( value, 1, MAX_THREADS, &count ) )
+					die( "Invalid number of threads '%s', expected 1 to %d", value, MAX_THREADS );
+				threads = count;
+				break;
+			case 'm':
+				if ( !parse_count( value, 0, SIZE_MAX >> 20, &count ) )
+					die( "Invalid table budget '%s', expected MEGABYTES", value );
+				table_budget = (size_t) count << 20;
+				break;
+			case 'o':
+				if ( !strcmp( value, "full" ) )
+					opts.output.crop = false;
+				else if ( !strcmp( value, "crop" ) )
+					opts.output.crop = true;
+				else
+					die( "Unknown output canvas '%s'", value );
+				break;
+			case 'p':
+				if ( sscanf( value, "%u:%u:%u:%u", &pipeline_config.depth,
+							pipeline_config.threads + PIPELINE_DECODE,
+							pipeline_config.threads + PIPELINE_RENDER,
+							pipeline_config.threads + PIPELINE_ENCODE ) < 1
+						|| !pipeline_config.depth
+						|| !pipeline_config.threads[ PIPELINE_DECODE ]
+						|| !pipeline_config.threads[ PIPELINE_RENDER ]
+						|| !pipeline_config.threads[ PIPELINE_ENCODE ] )
+					die( "Invalid pipeline '%s', expected DEPTH[:DECODERS:RENDERERS:ENCODERS]", value );
+				break;
+			case 's':
+				splat_name = value;
+				break;
+			case 'S':
+				/* stdin and stdout (progress lines) are never meant, stderr may be */
+				if ( !parse_count( value, 2, INT_MAX, &count ) )
+					die( "Invalid stats descriptor '%s', expected 2 or an open descriptor above", value );
+				opts.stats = fdopen( count, "w" );
+				if ( !opts.stats )
+					die( "Cannot write stats to descriptor '%s'", value );
+				break;
+			case 'T':
+				if ( !strcmp( value, "quick" ) )
+					selftest_templates_count = 1;
+				else if ( !strcmp( value, "full" ) )
+					selftest_templates_count = BENCH_COUNT( selftest_templates );
+				else
+					die( "Unknown self-test '%s', expected quick or full", value );
+				break;
+			case 't':
+				{
+					char *tail;
+					sat_tolerance = strtod( value, &tail );
+					if ( *tail || tail == value || !( sat_tolerance >= 0 ) )
+						die( "Invalid blur tolerance '%s', expected LEVELS >= 0", value );
+				}
+				break;
+			case 'z':
+				parse_png_encoding( value, &opts.output );
+				break;
+			case 'q':
+				if ( sscanf( value, "%u:%u", &params.radius_steps, &params.phase_steps ) != 2
+						|| !params.radius_steps || !params.phase_steps )
+					die( "Invalid quantization '%s', expected RADIUS_STEPS:PHASE_STEPS", value );
+				break;
+			case 'r':
+				{
+					char *tail;
+					params.scale = strtod( value, &tail );
+					if ( *tail || tail == value || !( params.scale > 0 && params.scale <= 1 ) )
+						die( "Invalid render scale '%s', expected 0 < SCALE <= 1", value );
+				}
+				break;
+			default:
+				die( "Unknown option '%s'", arg );
 		}
 	}
 
+	if ( opts.engine == ENGINE_SAT )
+		params.sat_tolerance = sat_tolerance;
+
+	if ( background && params.scale != 1 )
+	{
+		/* canvases are scaled by the tables, the background must follow */
+		image_file_t *scaled = image_scale( background,
+				floor( background->width * params.scale + 0.5 ),
+				floor( background->height * params.scale + 0.5 ) );
+		image_destroy( &background );
+		background = scaled;
+		opts.output.background = background;
+	}
+
+	if ( selftest_templates_count )
+		return selftest_run( selftest_templates_count ) ? 1 : 0;
+
+	if ( bench_reps )
+	{
+		if ( opts.engine == ENGINE_GATHER )
+			die( "The benchmark covers the scatter and sat engines only" );
+		opts.splat = splat_select( splat_name );
+		if ( threads > 1 )
+			opts.workers = workers_new( threads );
+		bench_run( &params, &opts, bench_reps );
+		if ( opts.workers )
+			workers_destroy( &opts.workers );
+		return 0;
+	}
+
+	if ( daemon_path )
+	{
+		daemon_t daemon;
+		if ( pipeline_config.depth )
+			die( "Pipelines cannot be used in daemon mode" );
+		memset( &daemon, 0, sizeof( daemon ) );
+		daemon.params = params;
+		daemon.opts = &opts;
+		daemon.tables.cache_dir = cache_dir;
+		daemon.tables.budget = table_budget;
+		opts.splat = splat_select( splat_name );
+		if ( threads > 1 )
+			opts.workers = workers_new( threads );
+
+		daemon_run( &daemon, daemon_path );
+
+		table_cache_clear( &daemon.tables );
+		if ( opts.workers )
+			workers_destroy( &opts.workers );
+		if ( background )
+			image_destroy( &background );
+		return 0;
+	}
+
+	if ( argc - first < 26 )
+	{
+		printf( "%s requires at least 26 arguments. You should try not run it manually.\n"
+				"Options:\n"
+				"  -a ACCUM  scatter accumulator: double (default), float or fixed\n"
+				"  -B N      run the synthetic benchmark N times, print JSON lines\n"
+				"  -b FILE   multiply every output onto background FILE (png or jpeg)\n"
+				"  -c DIR    keep transform tables in DIR and reuse them\n"
+				"  -d PATH   daemon: read jobs from stdin (-) or Unix socket PATH\n"
+				"  -e ENGINE scatter (default), gather, or sat: kernels are cut as far\n"
+				"            as -t allows, the rest of the blur is a disc per output pixel\n"
+				"  -g WxH    scale outputs to fit into WxH, box filtered\n"
+				"  -j N      render every image with N threads\n"
+				"  -m MB     daemon keeps tables of up to MB megabytes (default 1024)\n"
+				"  -o full   write the whole background sized canvas (default)\n"
+				"  -o crop   write only the rendered box, PNGs keep its offset (oFFs)\n"
+				"  -p Q[:D:R:E] pipeline images through D decoder, R renderer and\n"
+				"            E encoder threads with queues of Q images (default 1:1:1)\n"
+				"  -q R:P    share kernels quantized to 1/R px radius and 1/P px phase\n"
+				"  -r SCALE  render at SCALE (0 < SCALE <= 1) of the background size\n"
+				"  -s SIMD   splat kernels: scalar, sse2, avx2 or avx512 (default: best)\n"
+				"  -S FD     write JSON lines with per image timings and counters to FD\n"
+				"  -T SET    self-test every engine and option against the reference\n"
+				"            double path, quick or full, print JSON lines, fail if off\n"
+				"  -t LEVELS sat stays within LEVELS of 255 of the scatter engine at\n"
+				"            any edge, kernels are cut only as far as that allows\n"
+				"            (default 2)\n"
+				"  -z L[:F]  png zlib level 0-9 and filters: none, sub, up, avg, paeth\n"
+				"            or all, joined with ',' (default: libpng's 6:all)\n"
+				"Outputs named *.jpg, *.pam or *.qoi are written as JPEG, PAM or QOI,\n"
+				"others as PNG. Inputs may be any of them.\n",
+				argv[0]
+			  );
+		exit(0);
+	}
+
+	if ( opts.output.crop && opts.output.background )
+		die( "Cropped outputs cannot be composited, drop -b or -o crop" );
+
+	i = parse_table_params( argv + first, &params );
+	if ( i >= 0 )
+		die( "Invalid number '%s' in argument %d", argv[ first + i ], i );
+
+	opts.splat = splat_select( splat_name );
+	if ( threads > 1 )
+		opts.workers = workers_new( threads );
+
 	transform_table_t *transform_table;
-	transform_table = calc_transform_table( data, count / 2 );
+	geometry_cache_t geometry = { NULL, NULL };
+	transform_table = transform_table_obtain( &params, cache_dir, &geometry,
+			opts.workers, opts.stats );
+	geometry_cache_clear( &geometry );
+
+	if ( pipeline_config.depth )
+		pipeline = pipeline_new( transform_table, &opts, &pipeline_config );
+
+	render_opts_bind( &opts, transform_table );
 
 	char *in_file = NULL, *arg;
 	long int move_x = 0, move_y = 0;
 
-	i = 24;
+	i = first + 23;
 	while ( ++i < argc )
 	{
 		arg = argv[ i ];
 		if ( arg[0] == '+' || arg[0] == '-' )
 		{
-			char *tail = NULL, *tail2 = NULL;
-			char *end = arg + strlen( arg );
-			move_x = strtol( arg, &tail, 10 );
-			if ( !tail || tail == arg )
-				die( "Invalid position value in '%s'\n", arg );
-			move_y = strtol( tail, &tail2, 10 );
-			if ( !tail2 || tail2 == tail || tail2 != end )
+			if ( !parse_position( arg, &move_x, &move_y ) )
 				die( "Invalid position value in '%s'\n", arg );
 		}
 		else if ( ! in_file )
@@ -852,19 +7526,30 @@ main( int argc, char **argv )
 		}
 		else
 		{
-			image_process( transform_table, in_file, arg, move_x, move_y );
+			if ( pipeline )
+				pipeline_push( pipeline, in_file, arg, move_x, move_y );
+			else
+				image_process( transform_table, &opts, in_file, arg, move_x, move_y );
 			in_file = NULL;
 			move_x = 0;
 			move_y = 0;
 		}
 	}
 
+	if ( pipeline )
+		pipeline_finish( &pipeline );
+
 	if ( in_file )
 	{
 		printf( "Warning, there are unprocessed arguments: '%s'\n", in_file );
 	}
 
+	render_opts_release( &opts );
+	if ( opts.workers )
+		workers_destroy( &opts.workers );
 	destroy_transform_table( &transform_table );
+	if ( background )
+		image_destroy( &background );
 
 	return 0;
 }
@@ -0,0 +1,66 @@
+/*
+ * vim: ts=4:sw=4:fdm=marker
+ *
+ * (c) 2014 Przemyslaw Iskra <sparky@pld-linux.org>
+ * You can use this code under the terms of AGPL v3 license.
+ *
+ * libbender, live previews for calibration tools like cylinder-calculator.pl.
+ * Build it from bender.c with -DBENDER_LIBRARY, see there. Functions not
+ * declared here are not exported.
+ *
+ * Tables are built from every decimate-th patch row and column and rendered
+ * on a canvas decimate times smaller than the background, so a preview costs
+ * about 1 / decimate^2 of the full render. A bender_t is not thread-safe,
+ * and only one call may run in the whole process at a time.
+ */
+
+#ifndef BENDER_H
+#define BENDER_H
+
+/* bumped whenever a declaration below changes */
+#define BENDER_API_VERSION 1
+
+#ifdef __GNUC__
+#define BENDER_API __attribute__ (( visibility( "default" ) ))
+#else
+#define BENDER_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct bender_s bender_t;
+
+/* BENDER_API_VERSION the library was built with */
+BENDER_API unsigned int bender_api_version( void );
+
+/* decimate 1 renders at full size; returns NULL for 0 */
+BENDER_API bender_t *bender_new( unsigned int decimate );
+
+/*
+ * The 24 numbers of the bender command line, in the same order. Rebuilds
+ * the table if they changed, reusing the geometry when only the focus did.
+ * Returns 0, or -1 if they do not describe a mug, keeping the last table.
+ */
+BENDER_API int bender_set_numbers( bender_t *b, const double numbers[ 24 ] );
+
+/* preview canvas size, 0 x 0 until numbers are set */
+BENDER_API void bender_size( const bender_t *b,
+		unsigned long *width, unsigned long *height );
+
+/*
+ * Renders a full size, straight RGBA patch of width x height pixels into
+ * out, a straight RGBA canvas of bender_size() pixels. Rows are packed in
+ * both. Returns 0, or -1 if there is no table or rendering failed.
+ */
+BENDER_API int bender_render( bender_t *b, const unsigned char *patch,
+		unsigned long width, unsigned long height, unsigned char *out );
+
+BENDER_API void bender_free( bender_t *b );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENDER_H */
@@ -77,6 +77,11 @@ my $mouse_x = 0;
 my $mouse_y = 0;
 my $need_update = 1;
 my $move_update;
+
+# live preview through libbender at 1/4 size, toggled with p
+my $preview = preview_init( 4 );
+my $preview_on = 0;
+
 show();
 $app->run;
 
@@ -133,6 +138,11 @@ sub any_event
 		{
 			save();
 		}
+		elsif ( $sym == SDLK_p and $preview )
+		{
+			$preview_on = !$preview_on;
+			$need_update = 1;
+		}
 	}
 	elsif ( $t == SDL_VIDEORESIZE )
 	{
@@ -427,6 +437,8 @@ sub show
 	return unless $need_update;
 	$image->blit( $app, [ $image_move_x, $image_move_y, $app->w, $app->h] );
 	draw_points();
+	# needs the angles draw_points() has just found, guides go on top
+	draw_points() if $preview_on and preview_show();
 	$app->draw_line( [$mouse_x, 0], [$mouse_x, $app->h], $color->{cross} );
 	$app->draw_line( [0, $mouse_y], [$app->w, $mouse_y], $color->{cross} );
 	$app->update;
@@ -621,9 +633,9 @@ sub make_elipse3
 
 
 
-sub cmdline
+sub numbers
 {
-	my @data = (
+	return (
 		$image->w(), $image->h(),
 		945, 1063,
 		( map { ( $_->[0], $_->[1] ) } @points[ 0..5 ] ),
@@ -631,9 +643,81 @@ sub cmdline
 		( map { ( $_->[0], $_->[1] ) } @points[ 8..9 ] ),
 		$bokeh_r1, $bokeh_r2,
 	);
+}
+
+sub cmdline
+{
+	my @data = numbers();
 	return "./bender @data";
 }
 
+# libbender via FFI::Platypus, LIBBENDER points to it if not ./libbender.so
+sub preview_init
+{
+	my $decimate = shift;
+	my %p = ( decimate => $decimate );
+	my $ok = eval {
+		require FFI::Platypus;
+		require FFI::Platypus::Buffer;
+		require SDL::GFX::Rotozoom;
+		require SDL::Video;
+		require SDL::Rect;
+		my $ffi = FFI::Platypus->new( api => 1,
+			lib => $ENV{LIBBENDER} || './libbender.so' );
+		die "libbender API version mismatch\n"
+			unless $ffi->function( bender_api_version => [] => 'uint' )->call == 1;
+		$p{set_numbers} = $ffi->function( bender_set_numbers => [ 'opaque', 'double[24]' ] => 'int' );
+		$p{size} = $ffi->function( bender_size => [ 'opaque', 'ulong*', 'ulong*' ] => 'void' );
+		$p{render} = $ffi->function( bender_render =>
+			[ 'opaque', 'opaque', 'ulong', 'ulong', 'opaque' ] => 'int' );
+		$p{bender} = $ffi->function( bender_new => [ 'uint' ] => 'opaque' )->call( $decimate );
+		1;
+	};
+	unless ( $ok )
+	{
+		warn "No live preview: $@";
+		return;
+	}
+	return \%p;
+}
+
+# opaque checkerboard of 64 pixel squares
+sub test_card
+{
+	my ( $w, $h ) = @_;
+	my @cell = ( pack( 'C4', 230, 230, 230, 255 ), pack( 'C4', 40, 90, 200, 255 ) );
+	my @rows = map {
+		my $odd = $_;
+		substr join( '', map { $cell[ ( $_ + $odd ) & 1 ] x 64 } 0 .. $w / 64 ), 0, $w * 4;
+	} 0, 1;
+	return join '', map { $rows[ ( $_ >> 6 ) & 1 ] } 0 .. $h - 1;
+}
+
+sub preview_show
+{
+	my @data = numbers();
+	return if grep { not defined } @data;
+
+	my $b = $preview->{bender};
+	return if $preview->{set_numbers}->call( $b, \@data );
+	my ( $w, $h );
+	$preview->{size}->call( $b, \$w, \$h );
+	$preview->{patch} //= test_card( @data[ 2, 3 ] );
+	my $out = "\0" x ( $w * $h * 4 );
+	my ( $patch_ptr ) = FFI::Platypus::Buffer::scalar_to_buffer( $preview->{patch} );
+	my ( $out_ptr ) = FFI::Platypus::Buffer::scalar_to_buffer( $out );
+	return if $preview->{render}->call( $b, $patch_ptr, @data[ 2, 3 ], $out_ptr );
+
+	my $surface = SDL::Surface->new_from( $out, $w, $h, 32, $w * 4,
+		0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000 );
+	my $zoom = $preview->{decimate};
+	$surface = SDL::GFX::Rotozoom::zoom_surface( $surface, $zoom, $zoom, 1 );
+	SDL::Video::blit_surface( $surface,
+		SDL::Rect->new( $image_move_x, $image_move_y, $app->w, $app->h ),
+		$app, SDL::Rect->new( 0, 0, $app->w, $app->h ) );
+	return 1;
+}
+
 
 
 sub save